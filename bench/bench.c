@@ -0,0 +1,391 @@
+// Microbenchmarks of the kernels of the library. Every case is
+// repeated until it takes about -t seconds, five times, and the
+// fastest of them is kept, which is the least disturbed by the
+// rest of the machine. Results are printed as JSON with the
+// ns/op of every case and its GFLOP/s and GB/s where they make
+// sense, bytes counting every operand read or written once.
+//
+//   bench [-o out.json] [-b baseline.json] [-r tolerance] [-t secs] [-f filter]
+//
+// With -b every case is compared against the baseline, written
+// by an earlier run with -o, and the ones more than -r (0.10 by
+// default) slower are flagged. The exit status is 1 if any was.
+#include "../nn/nn.h"
+#include "../nn/gemm.h"
+
+#define BENCH_VERSION 1
+#define BENCH_REPEATS 5
+#define BENCH_MAX 64
+
+typedef struct Result {
+    char name[64];
+    double ns, gflops, gbps;
+} Result;
+
+typedef struct Bench {
+    double secs;
+    const char *filter;
+    Result r[BENCH_MAX];
+    size_t len;
+} Bench;
+
+typedef void (*BenchFn)(void *ctx);
+
+static void usage(void) {
+    fprintf(stderr, "usage: bench [-o out.json] [-b baseline.json] [-r tolerance] [-t secs] [-f filter]\n");
+    exit(1);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Returns the seconds iters calls of f take.
+static double bench_time(BenchFn f, void *ctx, size_t iters) {
+    double t = now();
+    for (size_t i = 0; i < iters; i++)
+        f(ctx);
+    return now() - t;
+}
+
+// Times f and records it as name, doing flops
+// operations and moving bytes per call.
+static void bench_run(Bench *b, const char *name, BenchFn f, void *ctx,
+                      double flops, double bytes) {
+    if (b->filter && !strstr(name, b->filter)) return;
+    assert(b->len < BENCH_MAX);
+
+    // Warms up and finds how many calls fill the time.
+    size_t iters = 1;
+    double t = bench_time(f, ctx, iters);
+    while (t < b->secs / 4 && iters < (1ul << 30)) {
+        iters *= 2;
+        t = bench_time(f, ctx, iters);
+    }
+    iters = t > 0 ? iters * b->secs / t : iters;
+    iters = iters > 0 ? iters : 1;
+
+    double best = INFINITY;
+    for (size_t i = 0; i < BENCH_REPEATS; i++) {
+        t = bench_time(f, ctx, iters) / iters;
+        best = t < best ? t : best;
+    }
+
+    Result *r = &b->r[b->len++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->ns = best * 1e9;
+    r->gflops = flops > 0 ? flops / best * 1e-9 : 0;
+    r->gbps = bytes > 0 ? bytes / best * 1e-9 : 0;
+    fprintf(stderr, "%-32s %14.1lf ns/op %9.2lf GFLOP/s %9.2lf GB/s\n",
+            r->name, r->ns, r->gflops, r->gbps);
+}
+
+typedef struct DotCtx {
+    Mat dst, a, b;
+} DotCtx;
+
+static void run_dot(void *ctx) {
+    DotCtx *c = ctx;
+    mat_dot(c->dst, c->a, c->b);
+}
+
+static void run_dot_sum(void *ctx) {
+    DotCtx *c = ctx;
+    mat_dot_sum(c->dst, c->a, c->b);
+}
+
+// Products of a (n,k) by a (k,m), from single samples to
+// square blocks bigger than the caches.
+static void bench_dot(Bench *b) {
+    size_t shapes[][3] = {
+        { 64, 64, 64 },
+        { 256, 256, 256 },
+        { 1024, 1024, 1024 },
+        { 1024, 1024, 1 },
+        { 4096, 4096, 8 },
+        { 512, 784, 64 },
+    };
+
+    for (size_t i = 0; i < sizeof(shapes) / sizeof(shapes[0]); i++) {
+        size_t n = shapes[i][0], k = shapes[i][1], m = shapes[i][2];
+        DotCtx c = {
+            .dst = mat_new(n, m),
+            .a = mat_rand_new(n, k),
+            .b = mat_rand_new(k, m),
+        };
+
+        char name[64];
+        double flops = 2.0 * n * m * k;
+        double bytes = sizeof(float) * (n*k + k*m + n*m);
+        snprintf(name, sizeof(name), "mat_dot/%zux%zux%zu", n, k, m);
+        bench_run(b, name, run_dot, &c, flops, bytes);
+        snprintf(name, sizeof(name), "mat_dot_sum/%zux%zux%zu", n, k, m);
+        bench_run(b, name, run_dot_sum, &c, flops, bytes + sizeof(float) * n*m);
+
+        mat_del(c.dst);
+        mat_del(c.a);
+        mat_del(c.b);
+    }
+}
+
+typedef struct FuncCtx {
+    Mat dst, src;
+    double (*f)(double);
+} FuncCtx;
+
+static void run_func(void *ctx) {
+    FuncCtx *c = ctx;
+    mat_func(c->dst, c->src, c->f);
+}
+
+static void run_softmax(void *ctx) {
+    FuncCtx *c = ctx;
+    mat_softmax(mat_copy(c->dst, c->src));
+}
+
+// Activations over a 1024x1024 matrix.
+static void bench_func(Bench *b) {
+    const char *names[] = { "relu", "tanh", "sigmoid", "lineal" };
+    double (*funcs[])(double) = { relu, tanh, sigmoid, lineal };
+    size_t n = 1024;
+    FuncCtx c = { .dst = mat_new(n, n), .src = mat_rand_new(n, n) };
+    double bytes = 2.0 * sizeof(float) * n * n;
+
+    char name[64];
+    for (size_t i = 0; i < sizeof(funcs) / sizeof(funcs[0]); i++) {
+        c.f = funcs[i];
+        snprintf(name, sizeof(name), "mat_func/%s", names[i]);
+        bench_run(b, name, run_func, &c, 0, bytes);
+    }
+
+    // Not element-wise, it goes through its own kernel.
+    bench_run(b, "mat_softmax", run_softmax, &c, 0, 3 * bytes);
+    mat_del(c.dst);
+    mat_del(c.src);
+}
+
+typedef struct LayerCtx {
+    Layer l;
+    Mat x;
+} LayerCtx;
+
+static void run_layer(void *ctx) {
+    LayerCtx *c = ctx;
+    lay_forward(c->l, c->x);
+}
+
+// A 1024 -> 1024 layer over a batch of 64 samples.
+static void bench_layer(Bench *b) {
+    const char *names[] = { "relu", "tanh", "sigmoid", "softmax" };
+    enum ACT_FUNC acts[] = { RELU, TANH, SIGMOID, SOFTMAX };
+    size_t n = 1024, cols = 64;
+    LayerCtx c = { .x = mat_rand_new(n, cols) };
+
+    char name[64];
+    for (size_t i = 0; i < sizeof(acts) / sizeof(acts[0]); i++) {
+        c.l = lay_new(n, n, acts[i]);
+        mat_del(c.l.z);
+        mat_del(c.l.a);
+        c.l.z = mat_new(n, cols);
+        c.l.a = mat_new(n, cols);
+
+        snprintf(name, sizeof(name), "lay_forward/%s", names[i]);
+        double bytes = sizeof(float) * (n*n + n + n*cols + 2*n*cols);
+        bench_run(b, name, run_layer, &c, 2.0 * n * n * cols, bytes);
+        lay_del(c.l);
+    }
+
+    mat_del(c.x);
+}
+
+typedef struct BackpropCtx {
+    NN n, g;
+    Mat x, y;
+} BackpropCtx;
+
+static void run_backprop(void *ctx) {
+    BackpropCtx *c = ctx;
+    backprop_forward(c->n, c->g, c->x, c->y);
+    backprop_backward(c->n, c->g, c->x);
+}
+
+// One step of a 784-256-128-10 classifier over a batch of 64,
+// a forward and the two products of the backward per layer.
+static void bench_backprop(Bench *b) {
+    size_t arch[] = { 784, 256, 128, 10 };
+    enum ACT_FUNC acts[] = { RELU, RELU, SOFTMAX };
+    size_t len = sizeof(arch) / sizeof(arch[0]), cols = 64;
+    BackpropCtx c = {
+        .n = nn_new(arch, acts, len),
+        .x = mat_rand_new(arch[0], cols),
+        .y = mat_new(arch[len-1], cols),
+    };
+
+    nn_reserve(c.n, cols);
+    c.g = new_nn_zero(c.n);
+    for (size_t j = 0; j < cols; j++)
+        MAT_AT(c.y, j % arch[len-1], j) = 1;
+
+    double flops = 0, bytes = 0;
+    for (size_t i = 0; i + 1 < len; i++) {
+        flops += 3 * 2.0 * arch[i] * arch[i+1] * cols;
+        bytes += sizeof(float) * 2 * (arch[i] * arch[i+1] + arch[i+1]);
+    }
+
+    bench_run(b, "backpropagation/784-256-128-10", run_backprop, &c, flops, bytes);
+    nn_del(c.n);
+    nn_del(c.g);
+    mat_del(c.x);
+    mat_del(c.y);
+}
+
+typedef struct SetCtx {
+    const char *path;
+    Set s;
+} SetCtx;
+
+static void run_from_csv(void *ctx) {
+    SetCtx *c = ctx;
+    set_del(set_from_csv(c->path, ","));
+}
+
+static void run_shuffle(void *ctx) {
+    SetCtx *c = ctx;
+    set_shuffle(c->s);
+}
+
+// Reading a CSV of 100000 rows of 16 values and
+// shuffling the rows of the set it holds.
+static void bench_set(Bench *b) {
+    size_t n = 100000, m = 16;
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/nnbench.%d.csv", (int) getpid());
+    FILE *f = fopen(path, "w");
+    assert(f != NULL);
+    for (size_t i = 0; i < n; i++)
+        for (size_t j = 0; j < m; j++)
+            fprintf(f, "%.6f%c", rand() / (double) RAND_MAX, j + 1 < m ? ',' : '\n');
+    double size = ftell(f);
+    fclose(f);
+
+    SetCtx c = { .path = path, .s = set_from_csv(path, ",") };
+    bench_run(b, "set_from_csv/100000x16", run_from_csv, &c, 0, size);
+    bench_run(b, "set_shuffle/100000x16", run_shuffle, &c, 0, 2.0 * sizeof(float) * n * m);
+    set_del(c.s);
+    remove(path);
+}
+
+typedef struct ModelCtx {
+    NN n;
+    const char *path;
+} ModelCtx;
+
+static void run_save(void *ctx) {
+    ModelCtx *c = ctx;
+    nn_save(c->n, c->path);
+}
+
+static void run_from(void *ctx) {
+    ModelCtx *c = ctx;
+    nn_del(nn_from(c->path));
+}
+
+// Saving and loading a 1024-1024-1024-10 model, about 8 MB.
+static void bench_model(Bench *b) {
+    size_t arch[] = { 1024, 1024, 1024, 10 };
+    enum ACT_FUNC acts[] = { RELU, RELU, SOFTMAX };
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/nnbench.%d.nn", (int) getpid());
+    ModelCtx c = { .n = nn_new(arch, acts, 4), .path = path };
+
+    double bytes = sizeof(float) * c.n.params->len;
+    bench_run(b, "nn_save/1024-1024-1024-10", run_save, &c, 0, bytes);
+    bench_run(b, "nn_from/1024-1024-1024-10", run_from, &c, 0, bytes);
+    nn_del(c.n);
+    remove(path);
+}
+
+static void bench_write(Bench *b, FILE *f) {
+    fprintf(f, "{\n  \"version\": %d,\n  \"kernel\": \"%s\",\n  \"results\": [\n",
+            BENCH_VERSION, gemm_kernel_name());
+    for (size_t i = 0; i < b->len; i++) {
+        Result *r = &b->r[i];
+        fprintf(f, "    { \"name\": \"%s\", \"ns_per_op\": %.1lf, \"gflops\": %.3lf, \"gbps\": %.3lf }%s\n",
+                r->name, r->ns, r->gflops, r->gbps, i + 1 < b->len ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+}
+
+// Compares b against the baseline at path, written by bench_write().
+// Returns the amount of cases slower than tolerance allows.
+static size_t bench_compare(Bench *b, const char *path, double tolerance) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror("Error opening baseline");
+        exit(1);
+    }
+
+    size_t slower = 0;
+    char *line = NULL;
+    size_t cap = 0;
+    fprintf(stderr, "\n%-32s %14s %14s %8s\n", "case", "baseline ns", "ns", "change");
+    while (getline(&line, &cap, f) > 0) {
+        char name[64];
+        double ns;
+        if (sscanf(line, " { \"name\": \"%63[^\"]\", \"ns_per_op\": %lf", name, &ns) != 2)
+            continue;
+
+        for (size_t i = 0; i < b->len; i++) {
+            if (strcmp(b->r[i].name, name) != 0) continue;
+            double change = b->r[i].ns / ns - 1;
+            bool slow = change > tolerance;
+            slower += slow;
+            fprintf(stderr, "%-32s %14.1lf %14.1lf %+7.1lf%%%s\n", name, ns, b->r[i].ns,
+                    change * 100, slow ? "  REGRESSION" : change < -tolerance ? "  faster" : "");
+        }
+    }
+
+    free(line);
+    fclose(f);
+    return slower;
+}
+
+int main(int argc, char **argv) {
+    const char *out = NULL, *baseline = NULL;
+    double tolerance = 0.10;
+    Bench b = { .secs = 0.1 };
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) out = argv[++i];
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) baseline = argv[++i];
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) tolerance = atof(argv[++i]);
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) b.secs = atof(argv[++i]);
+        else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) b.filter = argv[++i];
+        else usage();
+    }
+    if (b.secs <= 0 || tolerance < 0) usage();
+
+    srand(1);
+    bench_dot(&b);
+    bench_func(&b);
+    bench_layer(&b);
+    bench_backprop(&b);
+    bench_set(&b);
+    bench_model(&b);
+
+    FILE *f = out ? fopen(out, "w") : stdout;
+    if (!f) {
+        perror("Error opening output");
+        exit(1);
+    }
+
+    bench_write(&b, f);
+    if (out) fclose(f);
+
+    size_t slower = baseline ? bench_compare(&b, baseline, tolerance) : 0;
+    if (slower > 0)
+        fprintf(stderr, "%zu of %zu cases regressed more than %.0lf%%\n",
+                slower, b.len, tolerance * 100);
+    return slower > 0;
+}
@@ -0,0 +1,3 @@
+# !/bin/bash
+
+gcc bench.c ../nn/*.o -O3 -g -lm -pthread -o bench
@@ -0,0 +1,77 @@
+#include "act.h"
+
+// Every kernel is built for AVX-512, AVX2 and the
+// baseline ISA, the best one is picked at load time.
+#if defined(__x86_64__) && defined(__GNUC__)
+#define ACT_CLONES __attribute__((target_clones("avx512f", "avx2,fma", "default")))
+#else
+#define ACT_CLONES
+#endif
+
+// Applies the activation f in place to len contiguous
+// floats. The switch is taken once per row so every
+// case is a plain loop the compiler can vectorize.
+ACT_CLONES
+void act_row(enum ACT_FUNC f, float *x, size_t len) {
+    switch (f) {
+    case RELU:
+        for (size_t i = 0; i < len; i++)
+            x[i] = x[i] > 0 ? x[i] : 0;
+        break;
+    case TANH:
+        for (size_t i = 0; i < len; i++)
+            x[i] = act_tanh(x[i]);
+        break;
+    case SIGMOID:
+        for (size_t i = 0; i < len; i++)
+            x[i] = act_sigmoid(x[i]);
+        break;
+    default:
+        break;
+    }
+}
+
+// Stores in dst the derivative of the activation f
+// given its outputs a, so the backward pass doesn't
+// evaluate any transcendental function.
+ACT_CLONES
+void act_der_row(enum ACT_FUNC f, float *restrict dst, const float *restrict a, size_t len) {
+    switch (f) {
+    case RELU:
+        for (size_t i = 0; i < len; i++)
+            dst[i] = a[i] > 0;
+        break;
+    case TANH:
+        for (size_t i = 0; i < len; i++)
+            dst[i] = 1 - a[i] * a[i];
+        break;
+    case SIGMOID:
+        for (size_t i = 0; i < len; i++)
+            dst[i] = a[i] * (1 - a[i]);
+        break;
+    default:
+        for (size_t i = 0; i < len; i++)
+            dst[i] = 1;
+        break;
+    }
+}
+
+// Applies the softmax in place to the len contiguous
+// outputs of a sample. Its max is taken out before
+// exponentiating, so large inputs don't overflow.
+ACT_CLONES
+void act_softmax(float *x, size_t len) {
+    float max = x[0];
+    for (size_t i = 1; i < len; i++)
+        max = x[i] > max ? x[i] : max;
+
+    float sum = 0;
+    for (size_t i = 0; i < len; i++) {
+        x[i] = act_exp(x[i] - max);
+        sum += x[i];
+    }
+
+    float inv = 1 / sum;
+    for (size_t i = 0; i < len; i++)
+        x[i] *= inv;
+}
@@ -0,0 +1,101 @@
+#ifndef __ACT_H__
+#define __ACT_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+// SOFTMAX normalizes every sample over the outputs of its
+// layer, so it is only applied by whole samples and can only
+// be the activation of the output layer. Element-wise it is
+// left as the identity.
+enum ACT_FUNC { RELU, TANH, SIGMOID, LINEAL, SOFTMAX };
+
+// Branch-free approximations, so loops over them are
+// vectorized by the compiler. Measured against double
+// precision libm over every float:
+//   act_exp:     relative error below 1.5e-7 (~1 ulp) in
+//                [-87.3, 88.37], outside of it the input
+//                is clamped and the result saturates.
+//   act_tanh:    absolute error below 1.5e-7 and relative
+//                error below 2.5e-7.
+//   act_sigmoid: absolute error below 1.5e-7.
+// Loops only vectorize with -fno-trapping-math, otherwise
+// the clamps of act_exp can't be turned into selects.
+static inline float act_exp(float x) {
+    x = x < -87.3f ? -87.3f : x;
+    x = x > 88.37f ? 88.37f : x;
+
+    // x = n*ln(2) + r with |r| <= ln(2)/2. n is rounded
+    // adding 1.5*2^23, which leaves it in the low bits of
+    // the mantissa, and ln(2) is split in two constants
+    // to keep r exact.
+    float t = x * 1.44269504088896341f + 12582912.0f;
+    int32_t n;
+    memcpy(&n, &t, sizeof(n));
+    n -= 0x4b400000;
+    float fn = t - 12582912.0f;
+    float r = x - fn * 0.693359375f;
+    r = r + fn * 2.12194440e-4f;
+
+    float p = 1.9875691500e-4f;
+    p = p * r + 1.3981999507e-3f;
+    p = p * r + 8.3334519073e-3f;
+    p = p * r + 4.1665795894e-2f;
+    p = p * r + 1.6666665459e-1f;
+    p = p * r + 5.0000001201e-1f;
+    p = p * r * r + r + 1;
+
+    // Scales by 2^n building the exponent bits.
+    int32_t bits = (n + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+static inline float act_tanh(float x) {
+    // Odd polynomial close to 0, where 1 - 2/(e^2x + 1)
+    // would lose the relative precision.
+    float s = x * x;
+    float p = -5.70498872745e-3f;
+    p = p * s + 2.06390887954e-2f;
+    p = p * s - 5.37397155531e-2f;
+    p = p * s + 1.33314422036e-1f;
+    p = p * s - 3.33332819422e-1f;
+    p = p * s * x + x;
+
+    float ax = x < 0 ? -x : x;
+    float t = 1 - 2 / (act_exp(2 * ax) + 1);
+    t = x < 0 ? -t : t;
+    return ax < 0.625f ? p : t;
+}
+
+static inline float act_sigmoid(float x) {
+    return 1 / (1 + act_exp(-x));
+}
+
+// Applies the activation f to a single float.
+static inline float act_apply(enum ACT_FUNC f, float x) {
+    switch (f) {
+    case RELU:    return x > 0 ? x : 0;
+    case TANH:    return act_tanh(x);
+    case SIGMOID: return act_sigmoid(x);
+    default:      return x;
+    }
+}
+
+// Derivative of the activation f given its output a.
+static inline float act_der(enum ACT_FUNC f, float a) {
+    switch (f) {
+    case RELU:    return a > 0;
+    case TANH:    return 1 - a * a;
+    case SIGMOID: return a * (1 - a);
+    default:      return 1;
+    }
+}
+
+void act_row(enum ACT_FUNC f, float *x, size_t len);
+void act_der_row(enum ACT_FUNC f, float *dst, const float *a, size_t len);
+void act_softmax(float *x, size_t len);
+
+#endif // __ACT_H__
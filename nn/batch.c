@@ -0,0 +1,175 @@
+#include "batch.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Requests the row of set at i into the cache.
+static void batcher_touch(Set set, size_t i) {
+    const char *row = (const char *) &SET_AT(set, i, 0);
+    for (size_t k = 0; k < set.m * sizeof(MAT_TYPE); k += 64)
+        __builtin_prefetch(row + k);
+}
+
+// Gathers the batch starting at the from'th index of the
+// permutation into the buffers being prefetched, sample c
+// of the batch going to col c of x and y. Samples are
+// copied in blocks, so every row of the buffers is written
+// a block at a time, while the rows of the blocks ahead
+// are being fetched.
+static void batcher_pack(void *arg) {
+    Batcher *b = arg;
+    Mat x = b->x[b->next], y = b->y[b->next];
+    size_t from = b->packed;
+    size_t len = b->end - from < b->size ? b->end - from : b->size;
+    const size_t *perm = &b->perm[from];
+
+    for (size_t c = 0; c < len && c < 2 * BATCH_BLOCK; c++)
+        batcher_touch(b->set, perm[c]);
+
+    for (size_t c0 = 0; c0 < len; c0 += BATCH_BLOCK) {
+        size_t k = len - c0 < BATCH_BLOCK ? len - c0 : BATCH_BLOCK;
+        for (size_t c = c0 + 2 * BATCH_BLOCK; c < len && c < c0 + 3 * BATCH_BLOCK; c++)
+            batcher_touch(b->set, perm[c]);
+
+        const MAT_TYPE *rows[BATCH_BLOCK];
+        for (size_t c = 0; c < k; c++)
+            rows[c] = &SET_AT(b->set, perm[c0 + c], 0);
+
+        for (size_t j = 0; j < x.n; j++) {
+            MAT_TYPE *dst = &MAT_AT(x, j, c0);
+            for (size_t c = 0; c < k; c++)
+                dst[c] = rows[c][j];
+        }
+
+        for (size_t j = 0; j < y.n; j++) {
+            MAT_TYPE *dst = &MAT_AT(y, j, c0);
+            for (size_t c = 0; c < k; c++)
+                dst[c] = rows[c][x.n + j];
+        }
+    }
+}
+
+// Starts packing the batch after the last one handed out,
+// on the helper thread when there's one and the batch is
+// big enough.
+static void batcher_prefetch(Batcher *b) {
+    b->packed = b->from;
+    b->packing = true;
+    thpool_join_init(&b->join);
+    size_t bytes = b->size * b->set.m * sizeof(MAT_TYPE);
+    if (bytes < BATCH_ASYNC_MIN || thpool_spawn_join(b->packer, &b->join, batcher_pack, b))
+        batcher_pack(b);
+}
+
+// Returns a batcher of batches of up to `size` samples
+// of xs inputs and ys outputs.
+Batcher *batcher_new(size_t xs, size_t ys, size_t size) {
+    assert(size > 0);
+    Batcher *b = calloc(1, sizeof(Batcher));
+    assert(b != NULL);
+
+    b->xs = xs;
+    b->size = size;
+    for (size_t i = 0; i < 2; i++) {
+        b->x[i] = mat_new(xs, size);
+        b->y[i] = mat_new(ys, size);
+    }
+
+    // With a single core the helper could only take turns
+    // with training, so batches are packed inline.
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    b->packer = cores > 1 ? thpool_new(1) : NULL;
+    return b;
+}
+
+// Waits for the batch being packed, if any.
+static void batcher_wait(Batcher *b) {
+    if (b->packing) thpool_join(b->packer, &b->join);
+    b->packing = false;
+}
+
+// Moves k random entries of rows to its front, every
+// subset being as likely, leaving the rest after them.
+void rows_shuffle(size_t *rows, size_t len, size_t k) {
+    for (size_t i = 0; i < k && i + 1 < len; i++) {
+        size_t j = (rand() % (len - i)) + i;
+        size_t tmp = rows[i];
+        rows[i] = rows[j];
+        rows[j] = tmp;
+    }
+}
+
+// Makes the batcher visit the len rows of set given by
+// their indices in rows, or the first len when rows is
+// NULL. set is fp32 and its rows hold the inputs followed
+// by the outputs, it must stay valid while it's visited.
+// No pass is started until batcher_pass() is called.
+void batcher_set(Batcher *b, Set set, const size_t *rows, size_t len) {
+    assert(set.dtype == MAT_F32);
+    assert(set.m == b->xs + b->y[0].n);
+    assert(len <= set.n);
+    batcher_wait(b);
+
+    if (len > b->cap || !b->perm) {
+        free(b->perm);
+        b->cap = len > 0 ? len : 1;
+        b->perm = malloc(b->cap * sizeof(size_t));
+        assert(b->perm != NULL);
+    }
+
+    for (size_t i = 0; i < len; i++)
+        b->perm[i] = rows ? rows[i] : i;
+
+    b->set = set;
+    b->len = len;
+    b->from = b->end = 0;
+}
+
+// Starts a pass over len of the rows being visited. With
+// shuffle they're len random ones in a random order,
+// otherwise the first len in their current order.
+void batcher_pass(Batcher *b, size_t len, bool shuffle) {
+    assert(len <= b->len);
+    batcher_wait(b);
+    if (shuffle) rows_shuffle(b->perm, b->len, len);
+
+    b->from = 0;
+    b->end = len;
+    b->next = 0;
+}
+
+// Hands out the next batch in x and y, with one col per
+// sample. They stay valid until the following call.
+// Returns false when every batch was handed out.
+bool batcher_next(Batcher *b, Mat *x, Mat *y) {
+    if (!b->packing) {
+        if (b->from >= b->end) return false;
+        batcher_prefetch(b);
+    }
+
+    batcher_wait(b);
+    size_t from = b->from;
+    size_t len = b->end - from < b->size ? b->end - from : b->size;
+    size_t curr = b->next;
+    *x = mat_cols(b->x[curr], 0, len);
+    *y = mat_cols(b->y[curr], 0, len);
+
+    b->from += len;
+    b->next = !curr;
+    if (b->from < b->end) batcher_prefetch(b);
+    return true;
+}
+
+// Frees the batcher and its buffers.
+void batcher_del(Batcher *b) {
+    batcher_wait(b);
+    thpool_del(b->packer);
+    for (size_t i = 0; i < 2; i++) {
+        mat_del(b->x[i]);
+        mat_del(b->y[i]);
+    }
+
+    free(b->perm);
+    free(b);
+}
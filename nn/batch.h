@@ -0,0 +1,42 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include "set.h"
+#include "threadpool.h"
+#include <stdbool.h>
+
+// Samples gathered at a time when packing a batch.
+#define BATCH_BLOCK 16
+
+// Batches of fewer bytes are packed by the caller, handing
+// them to the helper thread would cost more than packing.
+#define BATCH_ASYNC_MIN (1 << 16)
+
+// Hands out the minibatches of some rows of a set in the
+// order of a permutation of their indices, so shuffling
+// never moves the rows themselves. Every batch is gathered
+// into contiguous buffers with one col per sample, the
+// layout the products of the network read with unit
+// stride. While a batch is handed out the next one is
+// packed by a helper thread.
+typedef struct Batcher {
+    Set set;
+    size_t xs, size;
+    size_t *perm;
+    size_t len, cap, end;
+    Mat x[2], y[2];
+    size_t from, packed, next;
+    ThreadPool *packer;
+    Join join;
+    bool packing;
+} Batcher;
+
+void rows_shuffle(size_t *rows, size_t len, size_t k);
+
+Batcher *batcher_new(size_t xs, size_t ys, size_t size);
+void batcher_set(Batcher *b, Set set, const size_t *rows, size_t len);
+void batcher_pass(Batcher *b, size_t len, bool shuffle);
+bool batcher_next(Batcher *b, Mat *x, Mat *y);
+void batcher_del(Batcher *b);
+
+#endif // __BATCH_H__
@@ -2,5 +2,12 @@
 
 gcc set.c -O3 -g -c -lm -o set.o &&
 gcc matrix.c -O3 -g -c -lm -o matrix.o &&
+gcc act.c -O3 -g -c -fno-trapping-math -o act.o &&
+gcc dtype.c -O3 -g -c -o dtype.o &&
+gcc gemm.c -O3 -g -c -pthread -o gemm.o &&
 gcc layer.c -O3 -g -c -o layer.o &&
-gcc threadpool.c -O3 -g -c -pthread -o threadpool.o
+gcc threadpool.c -O3 -g -c -pthread -o threadpool.o &&
+gcc stream.c -O3 -g -c -pthread -o stream.o &&
+gcc batch.c -O3 -g -c -pthread -o batch.o &&
+gcc quant.c -O3 -g -c -o quant.o &&
+gcc optim.c -O3 -g -c -fno-math-errno -o optim.o
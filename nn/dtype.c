@@ -0,0 +1,92 @@
+#include "dtype.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DTYPE_X86
+#endif
+
+#ifdef DTYPE_X86
+__attribute__((target("avx,f16c")))
+static void f16_to_f32_f16c(float *dst, const uint16_t *src, size_t len) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        __m128i h = _mm_loadu_si128((const __m128i *) (src + i));
+        _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
+    }
+    for (; i < len; i++)
+        dst[i] = f16_to_f32(src[i]);
+}
+
+__attribute__((target("avx,f16c")))
+static void f32_to_f16_f16c(uint16_t *dst, const float *src, size_t len) {
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128((__m128i *) (dst + i), h);
+    }
+    for (; i < len; i++)
+        dst[i] = f32_to_f16(src[i]);
+}
+#endif
+
+// True when the CPU converts fp16 in hardware.
+static int has_f16c(void) {
+#ifdef DTYPE_X86
+    static int f16c = -1;
+    if (f16c < 0) {
+        __builtin_cpu_init();
+        f16c = __builtin_cpu_supports("f16c") && __builtin_cpu_supports("avx");
+    }
+    return f16c;
+#else
+    return 0;
+#endif
+}
+
+// Converts len contiguous entries of type t to fp32.
+void dtype_to_f32(enum MAT_DTYPE t, float *dst, const void *src, size_t len) {
+    const uint16_t *h = src;
+    switch (t) {
+    case MAT_BF16:
+        for (size_t i = 0; i < len; i++)
+            dst[i] = bf16_to_f32(h[i]);
+        break;
+    case MAT_F16:
+#ifdef DTYPE_X86
+        if (has_f16c()) {
+            f16_to_f32_f16c(dst, h, len);
+            break;
+        }
+#endif
+        for (size_t i = 0; i < len; i++)
+            dst[i] = f16_to_f32(h[i]);
+        break;
+    default:
+        memcpy(dst, src, len * sizeof(float));
+        break;
+    }
+}
+
+// Converts len contiguous fp32 entries to type t.
+void dtype_from_f32(enum MAT_DTYPE t, void *dst, const float *src, size_t len) {
+    uint16_t *h = dst;
+    switch (t) {
+    case MAT_BF16:
+        for (size_t i = 0; i < len; i++)
+            h[i] = f32_to_bf16(src[i]);
+        break;
+    case MAT_F16:
+#ifdef DTYPE_X86
+        if (has_f16c()) {
+            f32_to_f16_f16c(h, src, len);
+            break;
+        }
+#endif
+        for (size_t i = 0; i < len; i++)
+            h[i] = f32_to_f16(src[i]);
+        break;
+    default:
+        memcpy(dst, src, len * sizeof(float));
+        break;
+    }
+}
@@ -0,0 +1,103 @@
+#ifndef __DTYPE_H__
+#define __DTYPE_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+// Storage types of matrices. Every kernel computes and
+// accumulates in fp32, bf16 and fp16 entries are only
+// converted when they are loaded or stored. The values
+// match the dtype field of the model and dataset files.
+enum MAT_DTYPE { MAT_F32, MAT_BF16, MAT_F16 };
+
+// Returns the size in bytes of an entry of type t.
+static inline size_t dtype_size(enum MAT_DTYPE t) {
+    return t == MAT_F32 ? sizeof(float) : sizeof(uint16_t);
+}
+
+static inline float bf16_to_f32(uint16_t h) {
+    uint32_t bits = (uint32_t) h << 16;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// Rounds to the nearest even bf16, NaNs stay quiet NaNs.
+static inline uint16_t f32_to_bf16(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    if ((x & 0x7fffffff) > 0x7f800000)
+        return (x >> 16) | 0x40;
+    return (x + 0x7fff + ((x >> 16) & 1)) >> 16;
+}
+
+static inline float f16_to_f32(uint16_t h) {
+    uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t man = h & 0x3ff;
+    uint32_t bits;
+    float f;
+
+    if (exp == 0x1f) {
+        bits = sign | 0x7f800000 | (man << 13);
+    } else if (exp != 0) {
+        bits = sign | ((exp + 112) << 23) | (man << 13);
+    } else {
+        // Zero or subnormal, exact in fp32.
+        f = (float) man * 0x1p-24f;
+        memcpy(&bits, &f, sizeof(bits));
+        bits |= sign;
+    }
+
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// Rounds to the nearest even fp16, values out of
+// its range become infinities.
+static inline uint16_t f32_to_f16(float f) {
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+    uint16_t sign = (x >> 16) & 0x8000;
+    x &= 0x7fffffff;
+
+    if (x >= 0x47800000)
+        return sign | (x > 0x7f800000 ? 0x7e00 : 0x7c00);
+
+    if (x < 0x38800000) {
+        // Subnormal, adding 0.5 leaves the rounded
+        // mantissa in the low bits.
+        float a;
+        memcpy(&a, &x, sizeof(a));
+        a += 0.5f;
+        memcpy(&x, &a, sizeof(x));
+        return sign | (uint16_t) (x - 0x3f000000);
+    }
+
+    x += 0xc8000fff + ((x >> 13) & 1);
+    return sign | (uint16_t) (x >> 13);
+}
+
+// Returns the i'th entry of data, of type t, as fp32.
+static inline float dtype_get(const void *data, size_t i, enum MAT_DTYPE t) {
+    switch (t) {
+    case MAT_BF16: return bf16_to_f32(((const uint16_t *) data)[i]);
+    case MAT_F16:  return f16_to_f32(((const uint16_t *) data)[i]);
+    default:       return ((const float *) data)[i];
+    }
+}
+
+// Stores v as the i'th entry of data, of type t.
+static inline void dtype_set(void *data, size_t i, enum MAT_DTYPE t, float v) {
+    switch (t) {
+    case MAT_BF16: ((uint16_t *) data)[i] = f32_to_bf16(v); break;
+    case MAT_F16:  ((uint16_t *) data)[i] = f32_to_f16(v); break;
+    default:       ((float *) data)[i] = v; break;
+    }
+}
+
+void dtype_to_f32(enum MAT_DTYPE t, float *dst, const void *src, size_t len);
+void dtype_from_f32(enum MAT_DTYPE t, void *dst, const float *src, size_t len);
+
+#endif // __DTYPE_H__
@@ -0,0 +1,644 @@
+#include "gemm.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GEMM_X86
+#endif
+
+// Epilogue of a single tile, bias holds its mr entries
+// and z, when not NULL, has a row stride of ldz.
+typedef struct TileEpi {
+    float bias[GEMM_MR_MAX];
+    float *z;
+    size_t ldz;
+    enum ACT_FUNC act;
+} TileEpi;
+
+// Computes the (mr,nr) tile a·b from packed slivers of
+// length k and stores it in c with row stride ldc. When
+// e isn't NULL its epilogue is applied before storing.
+typedef void (*gemm_kern_t)(size_t k, const float *a, const float *b,
+                            float *c, size_t ldc, bool acc, const TileEpi *e);
+
+// Activations cheap enough to be applied in registers, the
+// others are applied to the rows of the tile right after
+// they are stored, while they're still in L1.
+static bool act_in_regs(enum ACT_FUNC act) {
+    return act == RELU || act == LINEAL;
+}
+
+static void tile_act(const TileEpi *e, float *c, size_t ldc, size_t mr, size_t nr) {
+    if (!e || act_in_regs(e->act)) return;
+    for (size_t i = 0; i < mr; i++)
+        act_row(e->act, c + i*ldc, nr);
+}
+
+typedef struct GemmKernel {
+    const char *name;
+    size_t mr, nr;
+    gemm_kern_t kern;
+} GemmKernel;
+
+// Portable micro-kernel, the compiler is left to vectorize it.
+static void kern_scalar(size_t k, const float *a, const float *b,
+                        float *c, size_t ldc, bool acc, const TileEpi *e) {
+    float ab[4][8] = {0};
+    for (size_t p = 0; p < k; p++) {
+        for (size_t i = 0; i < 4; i++)
+            for (size_t j = 0; j < 8; j++)
+                ab[i][j] += a[i] * b[j];
+        a += 4;
+        b += 8;
+    }
+
+    for (size_t i = 0; i < 4; i++) {
+        for (size_t j = 0; j < 8; j++) {
+            float v = acc ? c[i*ldc + j] + ab[i][j] : ab[i][j];
+            if (e) {
+                v += e->bias[i];
+                if (e->z) e->z[i*e->ldz + j] = v;
+                v = act_apply(e->act, v);
+            }
+            c[i*ldc + j] = v;
+        }
+    }
+}
+
+#ifdef GEMM_X86
+// 6x16 tile, 12 ymm accumulators.
+__attribute__((target("avx2,fma")))
+static void kern_avx2(size_t k, const float *a, const float *b,
+                      float *c, size_t ldc, bool acc, const TileEpi *e) {
+    __m256 ab[6][2];
+    for (size_t i = 0; i < 6; i++)
+        ab[i][0] = ab[i][1] = _mm256_setzero_ps();
+
+    for (size_t p = 0; p < k; p++) {
+        __m256 b0 = _mm256_loadu_ps(b);
+        __m256 b1 = _mm256_loadu_ps(b + 8);
+        for (size_t i = 0; i < 6; i++) {
+            __m256 ai = _mm256_broadcast_ss(a + i);
+            ab[i][0] = _mm256_fmadd_ps(ai, b0, ab[i][0]);
+            ab[i][1] = _mm256_fmadd_ps(ai, b1, ab[i][1]);
+        }
+        a += 6;
+        b += 16;
+    }
+
+    for (size_t i = 0; i < 6; i++) {
+        float *ci = c + i*ldc;
+        if (acc) {
+            ab[i][0] = _mm256_add_ps(ab[i][0], _mm256_loadu_ps(ci));
+            ab[i][1] = _mm256_add_ps(ab[i][1], _mm256_loadu_ps(ci + 8));
+        }
+        if (e) {
+            __m256 bi = _mm256_set1_ps(e->bias[i]);
+            ab[i][0] = _mm256_add_ps(ab[i][0], bi);
+            ab[i][1] = _mm256_add_ps(ab[i][1], bi);
+            if (e->z) {
+                _mm256_storeu_ps(e->z + i*e->ldz, ab[i][0]);
+                _mm256_storeu_ps(e->z + i*e->ldz + 8, ab[i][1]);
+            }
+            if (e->act == RELU) {
+                ab[i][0] = _mm256_max_ps(ab[i][0], _mm256_setzero_ps());
+                ab[i][1] = _mm256_max_ps(ab[i][1], _mm256_setzero_ps());
+            }
+        }
+        _mm256_storeu_ps(ci, ab[i][0]);
+        _mm256_storeu_ps(ci + 8, ab[i][1]);
+    }
+
+    tile_act(e, c, ldc, 6, 16);
+}
+
+// 6x32 tile, 12 zmm accumulators.
+__attribute__((target("avx512f")))
+static void kern_avx512(size_t k, const float *a, const float *b,
+                        float *c, size_t ldc, bool acc, const TileEpi *e) {
+    __m512 ab[6][2];
+    for (size_t i = 0; i < 6; i++)
+        ab[i][0] = ab[i][1] = _mm512_setzero_ps();
+
+    for (size_t p = 0; p < k; p++) {
+        __m512 b0 = _mm512_loadu_ps(b);
+        __m512 b1 = _mm512_loadu_ps(b + 16);
+        for (size_t i = 0; i < 6; i++) {
+            __m512 ai = _mm512_set1_ps(a[i]);
+            ab[i][0] = _mm512_fmadd_ps(ai, b0, ab[i][0]);
+            ab[i][1] = _mm512_fmadd_ps(ai, b1, ab[i][1]);
+        }
+        a += 6;
+        b += 32;
+    }
+
+    for (size_t i = 0; i < 6; i++) {
+        float *ci = c + i*ldc;
+        if (acc) {
+            ab[i][0] = _mm512_add_ps(ab[i][0], _mm512_loadu_ps(ci));
+            ab[i][1] = _mm512_add_ps(ab[i][1], _mm512_loadu_ps(ci + 16));
+        }
+        if (e) {
+            __m512 bi = _mm512_set1_ps(e->bias[i]);
+            ab[i][0] = _mm512_add_ps(ab[i][0], bi);
+            ab[i][1] = _mm512_add_ps(ab[i][1], bi);
+            if (e->z) {
+                _mm512_storeu_ps(e->z + i*e->ldz, ab[i][0]);
+                _mm512_storeu_ps(e->z + i*e->ldz + 16, ab[i][1]);
+            }
+            if (e->act == RELU) {
+                ab[i][0] = _mm512_max_ps(ab[i][0], _mm512_setzero_ps());
+                ab[i][1] = _mm512_max_ps(ab[i][1], _mm512_setzero_ps());
+            }
+        }
+        _mm512_storeu_ps(ci, ab[i][0]);
+        _mm512_storeu_ps(ci + 16, ab[i][1]);
+    }
+
+    tile_act(e, c, ldc, 6, 32);
+}
+#endif
+
+static const GemmKernel kernels[] = {
+    { "scalar", 4, 8, kern_scalar },
+#ifdef GEMM_X86
+    { "avx2",   6, 16, kern_avx2 },
+    { "avx512", 6, 32, kern_avx512 },
+#endif
+};
+
+// Picks the widest micro-kernel the CPU supports.
+static const GemmKernel *gemm_kernel(void) {
+#ifdef GEMM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return &kernels[2];
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return &kernels[1];
+#endif
+    return &kernels[0];
+}
+
+const char *gemm_kernel_name(void) {
+    return gemm_kernel()->name;
+}
+
+// Buffers of a thread, so concurrent products don't step
+// on each other and no product allocates once they've
+// grown: the packing buffers, b transposed by skinny
+// products and the fp32 results of deep bf16 and fp16
+// ones. They're freed by the destructor of scratch_key
+// when the thread exits.
+typedef struct Scratch {
+    float *a, *b;
+    float *bt, *c;
+    size_t bt_len, c_len;
+    bool kept;
+} Scratch;
+
+static _Thread_local Scratch scratch;
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void scratch_free(void *arg) {
+    Scratch *s = arg;
+    free(s->a);
+    free(s->b);
+    free(s->bt);
+    free(s->c);
+    *s = (Scratch) {0};
+}
+
+static void scratch_key_new(void) {
+    int err = pthread_key_create(&scratch_key, scratch_free);
+    assert(err == 0);
+}
+
+// Returns the buffers of this thread.
+static Scratch *scratch_get(void) {
+    if (!scratch.kept) {
+        pthread_once(&scratch_once, scratch_key_new);
+        pthread_setspecific(scratch_key, &scratch);
+        scratch.kept = true;
+    }
+    return &scratch;
+}
+
+// Returns *buf with room for len floats at least,
+// growing it when it's smaller.
+static float *scratch_grow(float **buf, size_t *cap, size_t len) {
+    if (len > *cap) {
+        free(*buf);
+        *buf = malloc(sizeof(float) * len);
+        assert(*buf != NULL);
+        *cap = len;
+    }
+    return *buf;
+}
+
+static Scratch *pack_buffers(void) {
+    Scratch *s = scratch_get();
+    if (s->a) return s;
+    s->a = aligned_alloc(64, sizeof(float) * GEMM_MC * GEMM_KC);
+    s->b = aligned_alloc(64, sizeof(float) * GEMM_KC * GEMM_NC);
+    assert(s->a != NULL && s->b != NULL);
+    return s;
+}
+
+// Returns the address of the (i,j) entry of m.
+static void *gm_at(GemmMat m, size_t i, size_t j) {
+    return (char *) m.data + (i*m.rs + j*m.cs) * dtype_size(m.dtype);
+}
+
+// Returns m starting at its (i,j) entry.
+static GemmMat gm_sub(GemmMat m, size_t i, size_t j) {
+    m.data = gm_at(m, i, j);
+    return m;
+}
+
+// Packs the (mc,kc) block of a into slivers of mr rows,
+// each sliver stored column after column. Missing rows
+// of the last sliver are filled with zeros. Blocks with
+// contiguous rows are read one row at a time, converting
+// bf16 and fp16 rows first.
+static void pack_block_a(size_t mc, size_t kc, size_t mr, GemmMat a, float *dst) {
+    if (a.dtype == MAT_F32 && a.cs != 1) {
+        const float *p = a.data;
+        for (size_t ir = 0; ir < mc; ir += mr) {
+            size_t rows = mc - ir < mr ? mc - ir : mr;
+            for (size_t k = 0; k < kc; k++) {
+                for (size_t i = 0; i < rows; i++)
+                    dst[i] = p[(ir + i)*a.rs + k*a.cs];
+                for (size_t i = rows; i < mr; i++)
+                    dst[i] = 0;
+                dst += mr;
+            }
+        }
+        return;
+    }
+
+    float buf[GEMM_MR_MAX][GEMM_KC];
+    const float *rows_of[GEMM_MR_MAX];
+    assert(mr <= GEMM_MR_MAX);
+    for (size_t ir = 0; ir < mc; ir += mr) {
+        size_t rows = mc - ir < mr ? mc - ir : mr;
+        for (size_t i = 0; i < mr; i++) {
+            const void *src = gm_at(a, ir + i, 0);
+            rows_of[i] = buf[i];
+            if (i >= rows) {
+                memset(buf[i], 0, sizeof(float) * kc);
+            } else if (a.dtype == MAT_F32) {
+                rows_of[i] = src;
+            } else if (a.cs == 1) {
+                dtype_to_f32(a.dtype, buf[i], src, kc);
+            } else {
+                for (size_t k = 0; k < kc; k++)
+                    buf[i][k] = dtype_get(src, k*a.cs, a.dtype);
+            }
+        }
+
+        for (size_t k = 0; k < kc; k++)
+            for (size_t i = 0; i < mr; i++)
+                dst[k*mr + i] = rows_of[i][k];
+        dst += kc*mr;
+    }
+}
+
+// Packs the (kc,nc) panel of b into slivers of nr cols,
+// each sliver stored row after row. Missing cols of the
+// last sliver are filled with zeros.
+static void pack_panel_b(size_t kc, size_t nc, size_t nr, GemmMat b, float *dst) {
+    for (size_t jr = 0; jr < nc; jr += nr) {
+        size_t cols = nc - jr < nr ? nc - jr : nr;
+        for (size_t p = 0; p < kc; p++) {
+            const void *bp = gm_at(b, p, jr);
+            if (b.cs == 1) {
+                dtype_to_f32(b.dtype, dst, bp, cols);
+            } else if (b.dtype == MAT_F32) {
+                for (size_t j = 0; j < cols; j++)
+                    dst[j] = ((const float *) bp)[j*b.cs];
+            } else {
+                for (size_t j = 0; j < cols; j++)
+                    dst[j] = dtype_get(bp, j*b.cs, b.dtype);
+            }
+            for (size_t j = cols; j < nr; j++)
+                dst[j] = 0;
+            dst += nr;
+        }
+    }
+}
+
+// Runs the micro-kernel over every tile of the packed block.
+// Full tiles of a unit step fp32 c are written in place, edge
+// tiles and other dtypes go through a scratch tile first. The
+// epilogue, if any, is applied to the tiles as they are stored;
+// row0 and col0 are the offsets of the block in c.
+static void gemm_macro(const GemmKernel *kr, size_t mc, size_t nc, size_t kc,
+                       const float *ap, const float *bp, GemmMat c, bool acc,
+                       const GemmEpilogue *epi, size_t row0, size_t col0) {
+    float tile[GEMM_MR_MAX * GEMM_NR_MAX] __attribute__((aligned(64)));
+    size_t mr = kr->mr, nr = kr->nr;
+    bool in_place = c.dtype == MAT_F32 && c.cs == 1 && (!epi || !epi->z || epi->csz == 1);
+    TileEpi e;
+
+    for (size_t jr = 0; jr < nc; jr += nr) {
+        size_t cols = nc - jr < nr ? nc - jr : nr;
+        for (size_t ir = 0; ir < mc; ir += mr) {
+            size_t rows = mc - ir < mr ? mc - ir : mr;
+            const float *a = ap + ir*kc;
+            const float *b = bp + jr*kc;
+            void *cij = gm_at(c, ir, jr);
+
+            if (epi) {
+                for (size_t i = 0; i < rows; i++)
+                    e.bias[i] = epi->bias[(row0 + ir + i) * epi->rsbias];
+                e.z = epi->z ? epi->z + (row0 + ir)*epi->rsz + (col0 + jr)*epi->csz : NULL;
+                e.ldz = epi->rsz;
+                e.act = epi->act;
+            }
+
+            if (rows == mr && cols == nr && in_place) {
+                kr->kern(kc, a, b, cij, c.rs, acc, epi ? &e : NULL);
+                continue;
+            }
+
+            kr->kern(kc, a, b, tile, nr, false, NULL);
+            for (size_t i = 0; i < rows; i++) {
+                for (size_t j = 0; j < cols; j++) {
+                    size_t at = i*c.rs + j*c.cs;
+                    float v = tile[i*nr + j];
+                    if (acc) v += dtype_get(cij, at, c.dtype);
+                    if (epi) {
+                        v += e.bias[i];
+                        if (e.z) e.z[i*epi->rsz + j*epi->csz] = v;
+                        v = act_apply(e.act, v);
+                    }
+                    dtype_set(cij, at, c.dtype, v);
+                }
+            }
+        }
+    }
+}
+
+// Adds to sum[j] the dot product of the len entries of
+// row, stored as t, with the j'th of the n cols of bt,
+// each one stored every ldb floats.
+typedef void (*gemm_row_t)(const void *row, enum MAT_DTYPE t, const float *bt,
+                           size_t ldb, size_t len, size_t n, float *sum);
+
+// Portable row kernel, rows that aren't fp32 are
+// converted one slice at a time.
+static void row_scalar(const void *row, enum MAT_DTYPE t, const float *bt,
+                       size_t ldb, size_t len, size_t n, float *sum) {
+    float buf[GEMM_KC];
+    for (size_t pc = 0; pc < len; pc += GEMM_KC) {
+        size_t kc = len - pc < GEMM_KC ? len - pc : GEMM_KC;
+        const float *x = buf;
+        if (t == MAT_F32) x = (const float *) row + pc;
+        else dtype_to_f32(t, buf, (const char *) row + pc * dtype_size(t), kc);
+
+        for (size_t j = 0; j < n; j++) {
+            float s = 0;
+            for (size_t p = 0; p < kc; p++)
+                s += x[p] * bt[j*ldb + pc + p];
+            sum[j] += s;
+        }
+    }
+}
+
+#ifdef GEMM_X86
+// The n and t of the row kernels are made constants through
+// a switch, so every col keeps its accumulator in a register
+// and the row is widened to fp32 right as it's loaded.
+#define ROW_DISPATCH(body, row, t, bt, ldb, len, n, sum) \
+    switch (n) {                                        \
+    case 1: body(row, t, bt, ldb, len, 1, sum); break;  \
+    case 2: body(row, t, bt, ldb, len, 2, sum); break;  \
+    case 3: body(row, t, bt, ldb, len, 3, sum); break;  \
+    case 4: body(row, t, bt, ldb, len, 4, sum); break;  \
+    case 5: body(row, t, bt, ldb, len, 5, sum); break;  \
+    case 6: body(row, t, bt, ldb, len, 6, sum); break;  \
+    case 7: body(row, t, bt, ldb, len, 7, sum); break;  \
+    default: body(row, t, bt, ldb, len, 8, sum); break; \
+    }
+
+_Static_assert(GEMM_SKINNY_N == 8, "ROW_DISPATCH handles up to 8 cols");
+
+__attribute__((target("avx2,fma,f16c"), always_inline))
+static inline __m256 load8_avx2(const void *row, enum MAT_DTYPE t, size_t p) {
+    if (t == MAT_F32) return _mm256_loadu_ps((const float *) row + p);
+    __m128i h = _mm_loadu_si128((const __m128i *) ((const uint16_t *) row + p));
+    if (t == MAT_F16) return _mm256_cvtph_ps(h);
+    return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16));
+}
+
+__attribute__((target("avx2,fma,f16c"), always_inline))
+static inline void row_avx2_n(const void *row, enum MAT_DTYPE t, const float *bt,
+                              size_t ldb, size_t len, size_t n, float *sum) {
+    __m256 acc[GEMM_SKINNY_N];
+    for (size_t j = 0; j < n; j++)
+        acc[j] = _mm256_setzero_ps();
+
+    size_t p = 0;
+    for (; p + 8 <= len; p += 8) {
+        __m256 x = load8_avx2(row, t, p);
+        for (size_t j = 0; j < n; j++)
+            acc[j] = _mm256_fmadd_ps(x, _mm256_loadu_ps(bt + j*ldb + p), acc[j]);
+    }
+
+    for (size_t j = 0; j < n; j++) {
+        float lanes[8];
+        _mm256_storeu_ps(lanes, acc[j]);
+        float s = 0;
+        for (size_t l = 0; l < 8; l++)
+            s += lanes[l];
+        for (size_t q = p; q < len; q++)
+            s += dtype_get(row, q, t) * bt[j*ldb + q];
+        sum[j] += s;
+    }
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static void row_avx2(const void *row, enum MAT_DTYPE t, const float *bt,
+                     size_t ldb, size_t len, size_t n, float *sum) {
+    switch (t) {
+    case MAT_BF16: ROW_DISPATCH(row_avx2_n, row, MAT_BF16, bt, ldb, len, n, sum); break;
+    case MAT_F16:  ROW_DISPATCH(row_avx2_n, row, MAT_F16, bt, ldb, len, n, sum); break;
+    default:       ROW_DISPATCH(row_avx2_n, row, MAT_F32, bt, ldb, len, n, sum); break;
+    }
+}
+
+__attribute__((target("avx512f"), always_inline))
+static inline __m512 load16_avx512(const void *row, enum MAT_DTYPE t, size_t p) {
+    if (t == MAT_F32) return _mm512_loadu_ps((const float *) row + p);
+    __m256i h = _mm256_loadu_si256((const __m256i *) ((const uint16_t *) row + p));
+    if (t == MAT_F16) return _mm512_cvtph_ps(h);
+    return _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(h), 16));
+}
+
+__attribute__((target("avx512f"), always_inline))
+static inline void row_avx512_n(const void *row, enum MAT_DTYPE t, const float *bt,
+                                size_t ldb, size_t len, size_t n, float *sum) {
+    __m512 acc[GEMM_SKINNY_N];
+    for (size_t j = 0; j < n; j++)
+        acc[j] = _mm512_setzero_ps();
+
+    size_t p = 0;
+    for (; p + 16 <= len; p += 16) {
+        __m512 x = load16_avx512(row, t, p);
+        for (size_t j = 0; j < n; j++)
+            acc[j] = _mm512_fmadd_ps(x, _mm512_loadu_ps(bt + j*ldb + p), acc[j]);
+    }
+
+    for (size_t j = 0; j < n; j++) {
+        float s = _mm512_reduce_add_ps(acc[j]);
+        for (size_t q = p; q < len; q++)
+            s += dtype_get(row, q, t) * bt[j*ldb + q];
+        sum[j] += s;
+    }
+}
+
+__attribute__((target("avx512f")))
+static void row_avx512(const void *row, enum MAT_DTYPE t, const float *bt,
+                       size_t ldb, size_t len, size_t n, float *sum) {
+    switch (t) {
+    case MAT_BF16: ROW_DISPATCH(row_avx512_n, row, MAT_BF16, bt, ldb, len, n, sum); break;
+    case MAT_F16:  ROW_DISPATCH(row_avx512_n, row, MAT_F16, bt, ldb, len, n, sum); break;
+    default:       ROW_DISPATCH(row_avx512_n, row, MAT_F32, bt, ldb, len, n, sum); break;
+    }
+}
+#endif
+
+// Picks the widest row kernel the CPU supports.
+static gemm_row_t gemm_row_kernel(void) {
+#ifdef GEMM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+        return row_avx512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")
+        && __builtin_cpu_supports("f16c"))
+        return row_avx2;
+#endif
+    return row_scalar;
+}
+
+// Computes c = a·b for at most GEMM_SKINNY_N cols of b and
+// a with contiguous rows. fp32 b with contiguous cols is
+// read in place, any other is transposed to fp32 once. Every
+// row of a is streamed through once in its own dtype, so
+// bf16 and fp16 weights halve the bytes read.
+static void gemm_skinny(size_t m, size_t n, size_t k, GemmMat a, GemmMat b, GemmMat c,
+                        bool acc, const GemmEpilogue *epi) {
+    const float *bt = b.data;
+    size_t ldb = b.cs;
+    if (b.dtype != MAT_F32 || b.rs != 1) {
+        Scratch *s = scratch_get();
+        float *dst = scratch_grow(&s->bt, &s->bt_len, n * k);
+        for (size_t j = 0; j < n; j++) {
+            if (b.rs == 1) {
+                dtype_to_f32(b.dtype, dst + j*k, gm_at(b, 0, j), k);
+            } else {
+                for (size_t p = 0; p < k; p++)
+                    dst[j*k + p] = dtype_get(b.data, p*b.rs + j*b.cs, b.dtype);
+            }
+        }
+
+        bt = dst;
+        ldb = k;
+    }
+
+    gemm_row_t row = gemm_row_kernel();
+    for (size_t i = 0; i < m; i++) {
+        float sum[GEMM_SKINNY_N] = {0};
+        row(gm_at(a, i, 0), a.dtype, bt, ldb, k, n, sum);
+
+        for (size_t j = 0; j < n; j++) {
+            size_t at = i*c.rs + j*c.cs;
+            float v = acc ? sum[j] + dtype_get(c.data, at, c.dtype) : sum[j];
+            if (epi) {
+                v += epi->bias[i * epi->rsbias];
+                if (epi->z) epi->z[i*epi->rsz + j*epi->csz] = v;
+                v = act_apply(epi->act, v);
+            }
+            dtype_set(c.data, at, c.dtype, v);
+        }
+    }
+}
+
+void gemm_ex(size_t m, size_t n, size_t k, GemmMat a, GemmMat b, GemmMat c,
+             bool acc, const GemmEpilogue *epi) {
+    if (m == 0 || n == 0) return;
+    if (k == 0) {
+        for (size_t i = 0; i < m; i++) {
+            for (size_t j = 0; j < n; j++) {
+                size_t at = i*c.rs + j*c.cs;
+                float v = acc ? dtype_get(c.data, at, c.dtype) : 0;
+                if (epi) {
+                    v += epi->bias[i * epi->rsbias];
+                    if (epi->z) epi->z[i*epi->rsz + j*epi->csz] = v;
+                    v = act_apply(epi->act, v);
+                }
+                dtype_set(c.data, at, c.dtype, v);
+            }
+        }
+        return;
+    }
+
+    if (n <= GEMM_SKINNY_N && a.cs == 1) {
+        gemm_skinny(m, n, k, a, b, c, acc, epi);
+        return;
+    }
+
+    // bf16 and fp16 results of deep products are summed in
+    // a fp32 buffer, c is only written once every slice of
+    // k has been added.
+    if (c.dtype != MAT_F32 && k > GEMM_KC) {
+        Scratch *s = scratch_get();
+        float *buf = scratch_grow(&s->c, &s->c_len, m * n);
+        GemmMat tmp = { buf, n, 1, MAT_F32 };
+        for (size_t i = 0; i < m && acc; i++)
+            for (size_t j = 0; j < n; j++)
+                buf[i*n + j] = dtype_get(c.data, i*c.rs + j*c.cs, c.dtype);
+
+        gemm_ex(m, n, k, a, b, tmp, acc, epi);
+        for (size_t i = 0; i < m; i++)
+            for (size_t j = 0; j < n; j++)
+                dtype_set(c.data, i*c.rs + j*c.cs, c.dtype, buf[i*n + j]);
+        return;
+    }
+
+    const GemmKernel *kr = gemm_kernel();
+    Scratch *sc = pack_buffers();
+
+    for (size_t jc = 0; jc < n; jc += GEMM_NC) {
+        size_t nc = n - jc < GEMM_NC ? n - jc : GEMM_NC;
+        for (size_t pc = 0; pc < k; pc += GEMM_KC) {
+            size_t kc = k - pc < GEMM_KC ? k - pc : GEMM_KC;
+            // Only the first slice of k may overwrite c
+            // and only the last one runs the epilogue.
+            bool beta = acc || pc > 0;
+            const GemmEpilogue *last = pc + kc == k ? epi : NULL;
+            pack_panel_b(kc, nc, kr->nr, gm_sub(b, pc, jc), sc->b);
+
+            for (size_t ic = 0; ic < m; ic += GEMM_MC) {
+                size_t mc = m - ic < GEMM_MC ? m - ic : GEMM_MC;
+                pack_block_a(mc, kc, kr->mr, gm_sub(a, ic, pc), sc->a);
+                gemm_macro(kr, mc, nc, kc, sc->a, sc->b,
+                           gm_sub(c, ic, jc), beta, last, ic, jc);
+            }
+        }
+    }
+}
+
+void gemm(size_t m, size_t n, size_t k,
+          const float *a, size_t rsa, size_t csa,
+          const float *b, size_t rsb, size_t csb,
+          float *c, size_t rsc, size_t csc, bool acc) {
+    gemm_ex(m, n, k,
+            (GemmMat) { (void *) a, rsa, csa, MAT_F32 },
+            (GemmMat) { (void *) b, rsb, csb, MAT_F32 },
+            (GemmMat) { c, rsc, csc, MAT_F32 }, acc, NULL);
+}
@@ -0,0 +1,67 @@
+#ifndef __GEMM_H__
+#define __GEMM_H__
+
+#include "act.h"
+#include "dtype.h"
+#include <stdlib.h>
+#include <stdbool.h>
+
+// Cache blocking parameters. A block of GEMM_MC x GEMM_KC
+// entries of a is packed to live in L2 and a panel of
+// GEMM_KC x GEMM_NC entries of b is packed to live in L3,
+// each micro-kernel call streams one sliver of each from L1.
+#define GEMM_MC 144
+#define GEMM_KC 256
+#define GEMM_NC 2048
+
+// Products of row-major a with at most GEMM_SKINNY_N cols,
+// such as inference on a few samples, skip packing and read
+// every row of a once, they are bound by its bandwidth.
+#define GEMM_SKINNY_N 8
+
+// Biggest micro-tile of any kernel.
+#define GEMM_MR_MAX 8
+#define GEMM_NR_MAX 32
+
+// Computes c = a·b, or c += a·b when acc is true.
+// a is (m,k), b is (k,n) and c is (m,n), every operand
+// is addressed by a row stride and a column step so
+// transposed views can be multiplied without copies.
+void gemm(size_t m, size_t n, size_t k,
+          const float *a, size_t rsa, size_t csa,
+          const float *b, size_t rsb, size_t csb,
+          float *c, size_t rsc, size_t csc, bool acc);
+
+// Work done on every entry of c once its last slice of k is
+// summed, while the tile is still in registers: z = c + bias
+// and c = act(z). bias holds one entry per row of c, every
+// rsbias floats, and z is only stored when it isn't NULL.
+typedef struct GemmEpilogue {
+    const float *bias;
+    size_t rsbias;
+    float *z;
+    size_t rsz, csz;
+    enum ACT_FUNC act;
+} GemmEpilogue;
+
+// Operand of a product stored as dtype. Its entries are
+// addressed by a row stride and a column step, both
+// counted in entries.
+typedef struct GemmMat {
+    void *data;
+    size_t rs, cs;
+    enum MAT_DTYPE dtype;
+} GemmMat;
+
+// Computes c = a·b, or c += a·b when acc is true, for any
+// dtype of the operands. bf16 and fp16 operands are turned
+// into fp32 as they are packed and c is converted back when
+// stored, so every product accumulates in fp32. When epi
+// isn't NULL it turns the product into c = act(a·b + bias).
+void gemm_ex(size_t m, size_t n, size_t k, GemmMat a, GemmMat b, GemmMat c,
+             bool acc, const GemmEpilogue *epi);
+
+// Returns the name of the micro-kernel picked for this CPU.
+const char *gemm_kernel_name(void);
+
+#endif // __GEMM_H__
@@ -8,6 +8,7 @@ const act_func_t const funcs[] = {
     [TANH]    = tanh,
     [SIGMOID] = sigmoid,
     [LINEAL]  = lineal,
+    [SOFTMAX] = lineal,
 };
 
 const act_func_t const funcs_der[] = {
@@ -15,6 +16,7 @@ const act_func_t const funcs_der[] = {
     [TANH]    = tanh_der,
     [SIGMOID] = sigmoid_der,
     [LINEAL]  = lineal_der,
+    [SOFTMAX] = lineal_der,
 };
 
 double sigmoid(double x) {
@@ -72,6 +74,26 @@ Layer lay_new(size_t len, size_t input_size, enum ACT_FUNC act_func) {
     return l;
 }
 
+// Creates a new Layer whose weights and biases are
+// taken from params. Its activations are left empty.
+Layer lay_new_in(Arena *params, size_t len, size_t input_size, enum ACT_FUNC act_func) {
+    return lay_new_in_as(params, len, input_size, act_func, MAT_F32);
+}
+
+// Same as lay_new_in() storing the weights as dtype.
+// Biases are always fp32.
+Layer lay_new_in_as(Arena *params, size_t len, size_t input_size,
+                    enum ACT_FUNC act_func, enum MAT_DTYPE dtype) {
+    assert(act_func <= SOFTMAX);
+    return (Layer) {
+        .w = mat_new_in_as(params, len, input_size, dtype),
+        .b = mat_new_in(params, len, 1),
+        .act_func = act_func,
+        .act = funcs[act_func],
+        .der = funcs_der[act_func],
+    };
+}
+
 // Returns a copy of l with every
 // matrix filled with zeros.
 Layer lay_new_zero(Layer l) {
@@ -87,16 +109,41 @@ Layer lay_new_zero(Layer l) {
 }
 
 // Calculates the sum of the product of weights
-// applying the activation function.
+// applying the activation function. Every column
+// of x is a sample of the batch.
 Mat lay_forward(Layer l, Mat x) {
-    mat_sum(mat_dot(l.z, l.w, x), l.b);
-    return mat_func(l.a, l.z, l.act);
-}
+    return lay_forward_par(NULL, l, x, true);
+}
+
+// Same as lay_forward() splitting the product of wide
+// layers between the workers of pool. The bias and the
+// activation are fused into the product, z is only
+// written when training needs it.
+Mat lay_forward_par(ThreadPool *pool, Layer l, Mat x, bool train) {
+    assert(x.m <= l.z.m);
+    Mat z = train ? mat_cols(l.z, 0, x.m) : (Mat) {0};
+    Mat a = mat_cols(l.a, 0, x.m);
+    return mat_dense_par(pool, a, z, l.w, x, l.b, l.act_func);
+}
+
+// Stores in n the derivative of the activation function
+// given its outputs a and returns it. The derivatives of
+// every activation are expressed in terms of a, so the
+// backward pass doesn't need z. A softmax has no element-wise
+// derivative, its gradient is fused with the cross entropy.
+Mat lay_der(Layer l, Mat n, Mat a) {
+    assert(n.n == a.n);
+    assert(n.m == a.m);
+    if (n.step != 1 || a.step != 1) {
+        for (size_t i = 0; i < n.n; i++)
+            for (size_t j = 0; j < n.m; j++)
+                MAT_AT(n, i, j) = act_der(l.act_func, MAT_AT(a, i, j));
+        return n;
+    }
 
-// Applies the derivative of the activation function
-// to m, storing it in n and returning it.
-Mat lay_der(Layer l, Mat n, Mat m) {
-    return mat_func(n, m, l.der);
+    for (size_t i = 0; i < n.n; i++)
+        act_der_row(l.act_func, &MAT_AT(n, i, 0), &MAT_AT(a, i, 0), n.m);
+    return n;
 }
 
 // Prints the matrices of l.
@@ -159,16 +206,27 @@ Layer lay_from(FILE *f) {
         exit(1);
     }
 
+    Mat w = mat_from(f);
+    Mat b = mat_from(f);
+    return lay_from_mats(w, b, act);
+}
+
+// Creates a layer around the given weights and
+// biases, the layer takes ownership of them.
+Layer lay_from_mats(Mat w, Mat b, enum ACT_FUNC act_func) {
+    assert(w.n == b.n);
+    assert(act_func <= SOFTMAX);
     Layer l = (Layer) {
-        .w = mat_from(f),
-        .b = mat_from(f),
-        .z = mat_new(l.b.n, 1),
-        .a = mat_new(l.b.n, 1),
-        .act_func = act,
-        .act = funcs[act],
-        .der = funcs_der[act],
+        .w = w,
+        .b = b,
+        .z = mat_new(b.n, 1),
+        .a = mat_new(b.n, 1),
+        .act_func = act_func,
+        .act = funcs[act_func],
+        .der = funcs_der[act_func],
     };
 
+    lay_assert(l);
     return l;
 }
 
@@ -2,6 +2,7 @@
 #define __LAYER_H__
 
 #include "matrix.h"
+#include "act.h"
 #include <math.h>
 
 double sigmoid(double x);
@@ -14,7 +15,6 @@ double sigmoid_der(double x);
 double lineal_der(double x);
 
 typedef double (*act_func_t)(double);
-enum ACT_FUNC { RELU, TANH, SIGMOID, LINEAL };
 
 typedef struct Layer {
     Mat w, b, a, z;
@@ -25,13 +25,18 @@ typedef struct Layer {
 
 void lay_assert(Layer l);
 Layer lay_new(size_t len, size_t input_size, enum ACT_FUNC act_func);
+Layer lay_new_in(Arena *params, size_t len, size_t input_size, enum ACT_FUNC act_func);
+Layer lay_new_in_as(Arena *params, size_t len, size_t input_size,
+                    enum ACT_FUNC act_func, enum MAT_DTYPE dtype);
 Layer lay_new_zero(Layer l);
 Mat lay_forward(Layer l, Mat x);
-Mat lay_der(Layer l, Mat n, Mat m);
+Mat lay_forward_par(ThreadPool *pool, Layer l, Mat x, bool train);
+Mat lay_der(Layer l, Mat n, Mat a);
 void lay_print(Layer l, size_t i, size_t prev_size);
 void lay_fill_zeros(Layer l);
 void lay_save(Layer l, FILE *f);
 Layer lay_from(FILE *f);
+Layer lay_from_mats(Mat w, Mat b, enum ACT_FUNC act_func);
 void lay_del(Layer l);
 
 #endif // __LAYER_H__
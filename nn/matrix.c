@@ -1,10 +1,16 @@
 #include "matrix.h"
 #include "colors.h"
+#include "gemm.h"
 
 #include <assert.h>
+#include <stdbool.h>
+#include <string.h>
 #include <time.h>
 #include <math.h>
 
+// The gemm kernels work on single precision floats.
+_Static_assert(sizeof(MAT_TYPE) == sizeof(float), "MAT_TYPE must be float");
+
 // Generates a random value between [-1,1].
 MAT_TYPE randf() {
     return (MAT_TYPE)rand() / (MAT_TYPE)RAND_MAX * 2 - 1;
@@ -23,13 +29,20 @@ void mat_assert(Mat m) {
 
 // Returns an empty matrix.
 Mat mat_new(size_t n, size_t m) {
+    return mat_new_as(n, m, MAT_F32);
+}
+
+// Returns an empty matrix whose entries are stored as dtype.
+Mat mat_new_as(size_t n, size_t m, enum MAT_DTYPE dtype) {
+    MAT_TYPE *data = calloc(n * m, dtype_size(dtype));
     Mat r = {
-        .data = calloc(n * m, sizeof(MAT_TYPE)),
-        .free_ptr = r.data,
+        .data = data,
+        .free_ptr = data,
         .n = n,
         .m = m,
         .step = 1,
         .stride = m,
+        .dtype = dtype,
     };
 
     mat_assert(r);
@@ -43,6 +56,14 @@ Mat mat_rand_new(size_t n, size_t m) {
     return r;
 }
 
+// Fills m with random entries.
+Mat mat_rand(Mat m) {
+    for (size_t i = 0; i < m.n; i++)
+        for (size_t j = 0; j < m.m; j++)
+            MAT_AT(m, i, j) = randf();
+    return m;
+}
+
 // Fills a matrix with v.
 Mat mat_fill(Mat m, double v) {
     for (size_t i = 0; i < m.n; i++)
@@ -51,16 +72,55 @@ Mat mat_fill(Mat m, double v) {
     return m;
 }
 
+// Returns a view of m that shares its data.
+// The returned Mat doesn't need to be free'd using mat_del().
+Mat mat_view(Mat m) {
+    m.free_ptr = NULL;
+    return m;
+}
+
+// Returns the address of the (i,j) entry of m, for any dtype.
+MAT_TYPE *mat_ptr(Mat m, size_t i, size_t j) {
+    return (MAT_TYPE *) ((char *) m.data + (i*m.stride + j*m.step) * dtype_size(m.dtype));
+}
+
+// Returns the (i,j) entry of m as fp32.
+float mat_get(Mat m, size_t i, size_t j) {
+    return dtype_get(m.data, i*m.stride + j*m.step, m.dtype);
+}
+
+// Stores v in the (i,j) entry of m.
+void mat_set(Mat m, size_t i, size_t j, float v) {
+    dtype_set(m.data, i*m.stride + j*m.step, m.dtype, v);
+}
+
 // Returns a sub-matrix with the i'th row of entries.
 // The returned Mat doesn't need to be free'd using mat_del().
 Mat mat_row(Mat m, size_t i) {
     return (Mat) {
-        .data = &MAT_AT(m, i, 0),
+        .data = mat_ptr(m, i, 0),
         .free_ptr = NULL,
         .n = 1,
         .m = m.m,
         .step = m.step,
         .stride = 0,
+        .dtype = m.dtype,
+    };
+}
+
+// Returns a sub-matrix with the rows of m in the interval [from,to).
+// The returned Mat doesn't need to be free'd using mat_del().
+Mat mat_rows(Mat m, size_t from, size_t to) {
+    assert(from <= to);
+    assert(to <= m.n);
+    return (Mat) {
+        .data = mat_ptr(m, from, 0),
+        .free_ptr = NULL,
+        .n = to - from,
+        .m = m.m,
+        .step = m.step,
+        .stride = m.stride,
+        .dtype = m.dtype,
     };
 }
 
@@ -68,12 +128,29 @@ Mat mat_row(Mat m, size_t i) {
 // The returned Mat doesn't need to be free'd using mat_del().
 Mat mat_col(Mat m, size_t j) {
     return (Mat) {
-        .data = &MAT_AT(m, 0, j),
+        .data = mat_ptr(m, 0, j),
         .free_ptr = NULL,
         .n = m.n,
         .m = 1,
         .step = 0,
         .stride = m.stride,
+        .dtype = m.dtype,
+    };
+}
+
+// Returns a sub-matrix with the cols of m in the interval [from,to).
+// The returned Mat doesn't need to be free'd using mat_del().
+Mat mat_cols(Mat m, size_t from, size_t to) {
+    assert(from <= to);
+    assert(to <= m.m);
+    return (Mat) {
+        .data = mat_ptr(m, 0, from),
+        .free_ptr = NULL,
+        .n = m.n,
+        .m = to - from,
+        .step = m.step,
+        .stride = m.stride,
+        .dtype = m.dtype,
     };
 }
 
@@ -88,6 +165,31 @@ Mat mat_sum(Mat a, Mat b) {
     return a;
 }
 
+// Sums the column vector b to every column of a.
+// The result is then stored in a and returned.
+Mat mat_sum_col(Mat a, Mat b) {
+    assert(a.n == b.n);
+    assert(b.m == 1);
+    for (size_t i = 0; i < a.n; i++)
+        for (size_t j = 0; j < a.m; j++)
+            MAT_AT(a, i, j) += MAT_AT(b, i, 0);
+    return a;
+}
+
+// Stores the sum of every column of a
+// in the column vector dst and returns it.
+Mat mat_reduce_cols(Mat dst, Mat a) {
+    assert(dst.n == a.n);
+    assert(dst.m == 1);
+    for (size_t i = 0; i < a.n; i++) {
+        MAT_TYPE sum = 0;
+        for (size_t j = 0; j < a.m; j++)
+            sum += MAT_AT(a, i, j);
+        MAT_AT(dst, i, 0) = sum;
+    }
+    return dst;
+}
+
 // Adds every element of m and returns it's sum.
 double mat_add(Mat m) {
     MAT_TYPE sum = 0;
@@ -97,6 +199,86 @@ double mat_add(Mat m) {
     return (double) sum;
 }
 
+// Returns the sum of the squares of every element of m.
+double mat_sum_sq(Mat m) {
+    double sum = 0;
+    for (size_t i = 0; i < m.n; i++)
+        for (size_t j = 0; j < m.m; j++)
+            sum += MAT_AT(m, i, j) * MAT_AT(m, i, j);
+    return sum;
+}
+
+// Columns handled at once by the softmax kernels,
+// each one keeps its max and sums on the stack.
+#define MAT_SOFTMAX_COLS 64
+
+// Softmax cross entropy of every column of the logits z
+// against the targets y, computed with the log-sum-exp
+// trick: log softmax(z) = z - max - log(sum(e^(z - max))),
+// so no exponential overflows and no log sees a 0. The
+// probabilities minus y are stored in dst, the gradient
+// of the loss with respect to z, in the same sweep over
+// the batch that sums the loss. dst may be z, only the
+// probabilities are stored when y's data is NULL and
+// only the loss is computed when dst's data is NULL.
+// Returns the summed cross entropy.
+double mat_softmax_xent(Mat dst, Mat z, Mat y) {
+    assert(z.n > 0 && z.dtype == MAT_F32);
+    assert(!dst.data || (dst.n == z.n && dst.m == z.m && dst.dtype == MAT_F32));
+    assert(!y.data || (y.n == z.n && y.m == z.m && y.dtype == MAT_F32));
+    MAT_TYPE max[MAT_SOFTMAX_COLS], sum[MAT_SOFTMAX_COLS];
+    MAT_TYPE ysum[MAT_SOFTMAX_COLS], yz[MAT_SOFTMAX_COLS];
+    double loss = 0;
+
+    for (size_t from = 0; from < z.m; from += MAT_SOFTMAX_COLS) {
+        size_t cols = z.m - from < MAT_SOFTMAX_COLS ? z.m - from : MAT_SOFTMAX_COLS;
+        for (size_t j = 0; j < cols; j++) {
+            max[j] = MAT_AT(z, 0, from + j);
+            sum[j] = ysum[j] = yz[j] = 0;
+        }
+
+        for (size_t i = 1; i < z.n; i++)
+            for (size_t j = 0; j < cols; j++)
+                max[j] = MAT_AT(z, i, from + j) > max[j] ? MAT_AT(z, i, from + j) : max[j];
+
+        // The exponentials are kept in dst until their sum is known.
+        for (size_t i = 0; i < z.n; i++) {
+            for (size_t j = 0; j < cols; j++) {
+                MAT_TYPE v = MAT_AT(z, i, from + j) - max[j];
+                MAT_TYPE e = act_exp(v);
+                sum[j] += e;
+                if (dst.data) MAT_AT(dst, i, from + j) = e;
+                if (y.data) {
+                    ysum[j] += MAT_AT(y, i, from + j);
+                    yz[j] += MAT_AT(y, i, from + j) * v;
+                }
+            }
+        }
+
+        if (y.data)
+            for (size_t j = 0; j < cols; j++)
+                loss += ysum[j] * logf(sum[j]) - yz[j];
+
+        if (!dst.data) continue;
+        for (size_t j = 0; j < cols; j++)
+            sum[j] = 1 / sum[j];
+        for (size_t i = 0; i < z.n; i++) {
+            for (size_t j = 0; j < cols; j++) {
+                MAT_AT(dst, i, from + j) *= sum[j];
+                if (y.data) MAT_AT(dst, i, from + j) -= MAT_AT(y, i, from + j);
+            }
+        }
+    }
+
+    return loss;
+}
+
+// Applies the softmax to every column of m in place.
+Mat mat_softmax(Mat m) {
+    mat_softmax_xent(m, m, (Mat) {0});
+    return m;
+}
+
 // Performs the product between matrix a and scalar v.
 Mat mat_scalar(Mat a, double v) {
     for (size_t i = 0; i < a.n; i++)
@@ -125,110 +307,111 @@ Mat mat_t(Mat x) {
         .m = x.n,
         .step = x.stride,
         .stride = x.step,
+        .dtype = x.dtype,
     };
 }
 
-static Mat mat_dot_optimized(Mat dst, Mat a, Mat b) {
-    Mat bt = mat_new(b.m, b.n);
-    mat_assert(bt);
-
-    for (size_t i = 0; i < b.n; i++) {
-        for (size_t j = 0; j < b.m; j++) {
-            MAT_AT(bt, j, i) = MAT_AT(bt, i, j);
-        }
-    }
-
+// Multiplies a and b through the generic stride
+// and step of each matrix, for tiny products where
+// packing them for the gemm kernel doesn't pay off.
+static Mat mat_dot_naive(Mat dst, Mat a, Mat b, bool acc) {
     register MAT_TYPE sum;
     for (size_t i = 0; i < a.n; i++) {
-        for (size_t j = 0; j < bt.n; j++) {
+        for (size_t j = 0; j < b.m; j++) {
             sum = 0;
             for (size_t k = 0; k < a.m; k++) {
-                sum += MAT_AT(a, i, k) * MAT_AT(bt, j, k);
+                sum += MAT_AT(a, i, k) * MAT_AT(b, k, j);
             }
 
-            MAT_AT(dst, i, j) = sum;
+            MAT_AT(dst, i, j) = acc ? MAT_AT(dst, i, j) + sum : sum;
         }
     }
 
-    mat_del(bt);
     return dst;
 }
 
-// Performs the product between matrices a and b.
-// The result is then stored in dst and returned.
-Mat mat_dot(Mat dst, Mat a, Mat b) {
+// Describes m as an operand of gemm_ex().
+static GemmMat gemm_mat(Mat m) {
+    return (GemmMat) {
+        .data = m.data,
+        .rs = m.stride,
+        .cs = m.step,
+        .dtype = m.dtype,
+    };
+}
+
+// True when every given matrix is stored as fp32.
+static bool mat_f32(Mat a, Mat b, Mat c) {
+    return a.dtype == MAT_F32 && b.dtype == MAT_F32 && c.dtype == MAT_F32;
+}
+
+// Tiny fp32 products are computed in place, every
+// other product goes through the gemm kernel, which
+// also converts bf16 and fp16 operands.
+static Mat mat_dot_acc(Mat dst, Mat a, Mat b, bool acc) {
     assert(a.m == b.n);
     assert(dst.n == a.n);
     assert(dst.m == b.m);
 
-    if (dst.n > 100 && dst.m > 100) {
-        return mat_dot_optimized(dst, a, b);
-    }
-
-    register MAT_TYPE sum;
-    for (size_t i = 0; i < a.n; i++) {
-        for (size_t j = 0; j < b.m; j++) {
-            sum = 0;
-            for (size_t k = 0; k < a.m; k++) {
-                sum += MAT_AT(a, i, k) * MAT_AT(b, k, j);
-            }
-
-            MAT_AT(dst, i, j) = sum;
-        }
+    if (a.n * b.m * a.m < MAT_GEMM_MIN && mat_f32(dst, a, b)) {
+        return mat_dot_naive(dst, a, b, acc);
     }
 
+    gemm_ex(a.n, b.m, a.m, gemm_mat(a), gemm_mat(b), gemm_mat(dst), acc, NULL);
     return dst;
 }
 
-static Mat mat_dot_sum_optimized(Mat dst, Mat a, Mat b) {
-    Mat bt = mat_new(b.m, b.n);
-    mat_assert(bt);
-
-    for (size_t i = 0; i < b.n; i++) {
-        for (size_t j = 0; j < b.m; j++) {
-            MAT_AT(bt, j, i) = MAT_AT(bt, i, j);
-        }
-    }
-
-    register MAT_TYPE sum;
-    for (size_t i = 0; i < a.n; i++) {
-        for (size_t j = 0; j < bt.n; j++) {
-            sum = 0;
-            for (size_t k = 0; k < a.m; k++) {
-                sum += MAT_AT(a, i, k) * MAT_AT(bt, j, k);
-            }
-
-            MAT_AT(dst, i, j) += sum;
-        }
-    }
-
-    mat_del(bt);
-    return dst;
+// Performs the product between matrices a and b.
+// The result is then stored in dst and returned.
+Mat mat_dot(Mat dst, Mat a, Mat b) {
+    return mat_dot_acc(dst, a, b, false);
 }
 
 // Performs the product between matrices a and b.
 // The result is summed to dst and returned.
 Mat mat_dot_sum(Mat dst, Mat a, Mat b) {
-    assert(a.m == b.n);
-    assert(dst.n == a.n);
-    assert(dst.m == b.m);
-
-    if (dst.n > 100 && dst.m > 100) {
-        return mat_dot_sum_optimized(dst, a, b);
-    }
+    return mat_dot_acc(dst, a, b, true);
+}
 
-    register MAT_TYPE sum;
-    for (size_t i = 0; i < a.n; i++) {
-        for (size_t j = 0; j < b.m; j++) {
-            sum = 0;
-            for (size_t k = 0; k < a.m; k++) {
-                sum += MAT_AT(a, i, k) * MAT_AT(b, k, j);    
+// Computes the dense layer dst = act(w·x + b) with b broadcast
+// along the cols. The bias and the activation are applied in
+// the epilogue of the product, so dst is written once. z keeps
+// w·x + b unless its data is NULL. A softmax needs every output
+// of a sample, it is applied to the cols of dst afterwards.
+Mat mat_dense(Mat dst, Mat z, Mat w, Mat x, Mat b, enum ACT_FUNC act) {
+    if (act == SOFTMAX)
+        return mat_softmax(mat_dense(dst, z, w, x, b, LINEAL));
+
+    assert(w.m == x.n);
+    assert(dst.n == w.n && dst.m == x.m);
+    assert(b.n == w.n);
+    assert(!z.data || (z.n == dst.n && z.m == dst.m && z.dtype == MAT_F32));
+    assert(b.dtype == MAT_F32);
+
+    if (w.n * x.m * w.m < MAT_GEMM_MIN && mat_f32(dst, w, x)) {
+        for (size_t i = 0; i < dst.n; i++) {
+            for (size_t j = 0; j < dst.m; j++) {
+                MAT_TYPE sum = 0;
+                for (size_t k = 0; k < w.m; k++)
+                    sum += MAT_AT(w, i, k) * MAT_AT(x, k, j);
+                sum += MAT_AT(b, i, 0);
+                if (z.data) MAT_AT(z, i, j) = sum;
+                MAT_AT(dst, i, j) = act_apply(act, sum);
             }
-            
-            MAT_AT(dst, i, j) += sum;
         }
+        return dst;
     }
 
+    GemmEpilogue epi = {
+        .bias = b.data,
+        .rsbias = b.stride,
+        .z = z.data,
+        .rsz = z.stride,
+        .csz = z.step,
+        .act = act,
+    };
+
+    gemm_ex(w.n, x.m, w.m, gemm_mat(w), gemm_mat(x), gemm_mat(dst), false, &epi);
     return dst;
 }
 
@@ -244,9 +427,17 @@ Mat mat_mul(Mat a, Mat b) {
 }
 
 // Copies matrix b to a and returns it.
+// The entries are converted if their dtypes differ.
 Mat mat_copy(Mat a, Mat b) {
     assert(a.n == b.n);
     assert(a.m == b.m);
+    if (a.dtype != MAT_F32 || b.dtype != MAT_F32) {
+        for (size_t i = 0; i < a.n; i++)
+            for (size_t j = 0; j < a.m; j++)
+                mat_set(a, i, j, mat_get(b, i, j));
+        return a;
+    }
+
     for (size_t i = 0; i < a.n; i++)
         for (size_t j = 0; j < a.m; j++)
             MAT_AT(a, i, j) = MAT_AT(b, i, j);
@@ -264,6 +455,139 @@ Mat mat_func(Mat n, Mat m, double (*f)(double x)) {
     return n;
 }
 
+// Kernels run by the workers of a pool, each
+// task computes one tile of the output matrix.
+enum MAT_OP { OP_DOT, OP_DOT_SUM, OP_DENSE, OP_FUNC, OP_SUM, OP_SUB };
+
+typedef struct MatTask {
+    enum MAT_OP op;
+    Mat dst, a, b;
+    double (*f)(double);
+    Mat z, bias;
+    enum ACT_FUNC act;
+} MatTask;
+
+static void mat_task(void *arg) {
+    MatTask *t = arg;
+    switch (t->op) {
+    case OP_DOT:     mat_dot(t->dst, t->a, t->b); break;
+    case OP_DOT_SUM: mat_dot_sum(t->dst, t->a, t->b); break;
+    case OP_DENSE:   mat_dense(t->dst, t->z, t->a, t->b, t->bias, t->act); break;
+    case OP_FUNC:    mat_func(t->dst, t->a, t->f); break;
+    case OP_SUM:     mat_sum(t->dst, t->a); break;
+    case OP_SUB:     mat_sub(t->dst, t->a); break;
+    }
+}
+
+// Returns the i'th of `parts` tiles of m, splitting
+// its rows or its cols.
+static Mat mat_tile(Mat m, size_t parts, size_t i, bool rows) {
+    size_t len = rows ? m.n : m.m;
+    size_t from = len * i / parts;
+    size_t to = len * (i+1) / parts;
+    return rows ? mat_rows(m, from, to) : mat_cols(m, from, to);
+}
+
+typedef struct MatTiles {
+    MatTask t;
+    size_t parts;
+    bool rows;
+} MatTiles;
+
+// Computes the tiles [begin,end) of the output. Products
+// only split the operand that owns the tiled side of dst.
+static void mat_tiles(size_t begin, size_t end, void *ctx) {
+    MatTiles *tiles = ctx;
+    enum MAT_OP op = tiles->t.op;
+    bool dot = op == OP_DOT || op == OP_DOT_SUM || op == OP_DENSE;
+    for (size_t i = begin; i < end; i++) {
+        MatTask t = tiles->t;
+        t.dst = mat_tile(t.dst, tiles->parts, i, tiles->rows);
+        if (!dot || tiles->rows) t.a = mat_tile(t.a, tiles->parts, i, tiles->rows);
+        else t.b = mat_tile(t.b, tiles->parts, i, tiles->rows);
+        if (op == OP_DENSE && t.z.data) t.z = mat_tile(t.z, tiles->parts, i, tiles->rows);
+        if (op == OP_DENSE && tiles->rows) t.bias = mat_tile(t.bias, tiles->parts, i, true);
+        mat_task(&t);
+    }
+}
+
+// Splits the output of t along its longest side in as many
+// tiles as there are threads and runs them on the pool, the
+// calling thread taking part. Safe to call from a task of pool.
+static void mat_par(ThreadPool *pool, MatTask t, size_t work) {
+    size_t parts = thpool_len(pool) + 1;
+    parts = parts < MAT_PAR_MAX_TASKS ? parts : MAT_PAR_MAX_TASKS;
+    if (!pool || work < MAT_PAR_MIN || parts < 2) {
+        mat_task(&t);
+        return;
+    }
+
+    bool rows = t.dst.n >= t.dst.m;
+    size_t len = rows ? t.dst.n : t.dst.m;
+    MatTiles tiles = {
+        .t = t,
+        .parts = parts < len ? parts : len,
+        .rows = rows,
+    };
+
+    thpool_parallel_for(pool, 0, tiles.parts, 1, mat_tiles, &tiles);
+}
+
+// Parallel mat_dot(), serial when pool is NULL or the product is small.
+Mat mat_dot_par(ThreadPool *pool, Mat dst, Mat a, Mat b) {
+    assert(a.m == b.n);
+    MatTask t = { .op = OP_DOT, .dst = dst, .a = a, .b = b };
+    mat_par(pool, t, a.n * b.m * a.m);
+    return dst;
+}
+
+// Parallel mat_dense(), serial when pool is NULL or the product is small.
+Mat mat_dense_par(ThreadPool *pool, Mat dst, Mat z, Mat w, Mat x, Mat b, enum ACT_FUNC act) {
+    assert(w.m == x.n);
+    MatTask t = {
+        .op = OP_DENSE,
+        .dst = dst,
+        .a = w,
+        .b = x,
+        .z = z,
+        .bias = b,
+        .act = act == SOFTMAX ? LINEAL : act,
+    };
+
+    // Tiles may split the outputs of a sample.
+    mat_par(pool, t, w.n * x.m * w.m);
+    return act == SOFTMAX ? mat_softmax(dst) : dst;
+}
+
+// Parallel mat_dot_sum(), serial when pool is NULL or the product is small.
+Mat mat_dot_sum_par(ThreadPool *pool, Mat dst, Mat a, Mat b) {
+    assert(a.m == b.n);
+    MatTask t = { .op = OP_DOT_SUM, .dst = dst, .a = a, .b = b };
+    mat_par(pool, t, a.n * b.m * a.m);
+    return dst;
+}
+
+// Parallel mat_func(), serial when pool is NULL or the matrix is small.
+Mat mat_func_par(ThreadPool *pool, Mat n, Mat m, double (*f)(double x)) {
+    MatTask t = { .op = OP_FUNC, .dst = n, .a = m, .f = f };
+    mat_par(pool, t, n.n * n.m * MAT_PAR_FUNC_COST);
+    return n;
+}
+
+// Parallel mat_sum(), serial when pool is NULL or the matrix is small.
+Mat mat_sum_par(ThreadPool *pool, Mat a, Mat b) {
+    MatTask t = { .op = OP_SUM, .dst = a, .a = b };
+    mat_par(pool, t, a.n * a.m);
+    return a;
+}
+
+// Parallel mat_sub(), serial when pool is NULL or the matrix is small.
+Mat mat_sub_par(ThreadPool *pool, Mat a, Mat b) {
+    MatTask t = { .op = OP_SUB, .dst = a, .a = b };
+    mat_par(pool, t, a.n * a.m);
+    return a;
+}
+
 // Returns the index of the highest value in m.
 size_t mat_argmax(Mat m) {
     size_t max_i = 0;
@@ -281,10 +605,11 @@ size_t mat_argmax(Mat m) {
 
 // Saves m to a file.
 void mat_save(Mat m, FILE *f) {
+    assert(m.dtype == MAT_F32);
     size_t written = 0;
     written += fwrite(&m.n, sizeof(m.n), 1, f);
     written += fwrite(&m.m, sizeof(m.m), 1, f);
-    written += fwrite(m.data, sizeof(MAT_TYPE), m.n * m.m, f);
+    written += fwrite(m.data, sizeof(MAT_TYPE), m.n * m.m, f) == m.n * m.m;
     if (written != 3) {
         fprintf(stderr, "Error saving matrix");
         fclose(f);
@@ -314,6 +639,89 @@ void mat_del(Mat m) {
     free(m.free_ptr);
 }
 
+// Returns the amount of entries a (n,m) matrix takes in an arena.
+size_t arena_size(size_t n, size_t m) {
+    size_t align = MAT_ALIGN / sizeof(MAT_TYPE);
+    return (n * m + align - 1) / align * align;
+}
+
+// Returns the amount of arena entries a (n,m) matrix
+// of dtype entries takes.
+size_t arena_size_as(size_t n, size_t m, enum MAT_DTYPE dtype) {
+    size_t bytes = n * m * dtype_size(dtype);
+    return arena_size((bytes + sizeof(MAT_TYPE) - 1) / sizeof(MAT_TYPE), 1);
+}
+
+// Returns an empty arena of cap entries filled with zeros.
+Arena arena_new(size_t cap) {
+    cap = arena_size(cap > 0 ? cap : 1, 1);
+    MAT_TYPE *data = aligned_alloc(MAT_ALIGN, cap * sizeof(MAT_TYPE));
+    assert(data != NULL);
+    memset(data, 0, cap * sizeof(MAT_TYPE));
+
+    return (Arena) {
+        .data = data,
+        .free_ptr = data,
+        .len = 0,
+        .cap = cap,
+    };
+}
+
+// Returns an empty arena over cap entries of data. Matrices
+// allocated from it land on the same offsets as the ones of
+// the arena data was taken from.
+// The returned Arena doesn't need to be free'd using arena_del().
+Arena arena_view(MAT_TYPE *data, size_t cap) {
+    return (Arena) {
+        .data = data,
+        .free_ptr = NULL,
+        .len = 0,
+        .cap = cap,
+    };
+}
+
+// Allocates a (n,m) matrix from the arena.
+// The returned Mat doesn't need to be free'd using mat_del().
+Mat mat_new_in(Arena *arena, size_t n, size_t m) {
+    return mat_new_in_as(arena, n, m, MAT_F32);
+}
+
+// Allocates a (n,m) matrix of dtype entries from the arena.
+// The returned Mat doesn't need to be free'd using mat_del().
+Mat mat_new_in_as(Arena *arena, size_t n, size_t m, enum MAT_DTYPE dtype) {
+    size_t size = arena_size_as(n, m, dtype);
+    assert(arena->len + size <= arena->cap);
+    Mat r = {
+        .data = arena->data + arena->len,
+        .free_ptr = NULL,
+        .n = n,
+        .m = m,
+        .step = 1,
+        .stride = m,
+        .dtype = dtype,
+    };
+
+    arena->len += size;
+    return r;
+}
+
+// Returns every allocated entry of the arena as a (1,len) matrix.
+Mat arena_mat(Arena arena) {
+    return (Mat) {
+        .data = arena.data,
+        .free_ptr = NULL,
+        .n = 1,
+        .m = arena.len,
+        .step = 1,
+        .stride = arena.len,
+    };
+}
+
+// Frees the memory used by arena.
+void arena_del(Arena arena) {
+    free(arena.free_ptr);
+}
+
 // Prints m with name and padding.
 void mat_print_with_str(Mat m, const char *str, int pad) {
     printf(WHITE"%*s%s", pad, "", str);
@@ -321,7 +729,7 @@ void mat_print_with_str(Mat m, const char *str, int pad) {
     for (size_t i = 0; i < m.n; i++) {
         printf(BLACK"%*s[  ", pad, "");
         for (size_t j = 0; j < m.m; j++) {
-            MAT_TYPE v = MAT_AT(m, i, j);
+            MAT_TYPE v = mat_get(m, i, j);
             snprintf(buff, 6, "%.3lf", fabs(v));
             printf(v < 0 ? RED"%s  " : (v == 0 ? WHITE"%s  " : GREEN"%s  "), buff);
         }
@@ -337,7 +745,7 @@ void mat_print_no_nl(Mat m, const char *str) {
     for (size_t i = 0; i < m.n; i++) {
         printf(BLACK"[  ");
         for (size_t j = 0; j < m.m; j++) {
-            MAT_TYPE v = MAT_AT(m, i, j);
+            MAT_TYPE v = mat_get(m, i, j);
             snprintf(buff, 6, "%.3lf", fabs(v));
             printf(v < 0 ? RED"%s  " : (v == 0 ? WHITE"%s  " : GREEN"%s  "), buff);
         }
@@ -1,16 +1,47 @@
 #ifndef __MATRIX_H__
 #define __MATRIX_H__
 
+#include "threadpool.h"
+#include "act.h"
+#include "dtype.h"
 #include <stdlib.h>
 #include <stdio.h>
 
 #define MAT_TYPE float
 
+// Products with less multiplications than this
+// skip the packed gemm kernel.
+#define MAT_GEMM_MIN (16*16*16)
+
+// Parallel kernels run serially below this amount of
+// work, counted in multiplications for products and in
+// elements for element-wise kernels. An activation is
+// considered MAT_PAR_FUNC_COST times as costly as a sum.
+#define MAT_PAR_MIN (1 << 16)
+#define MAT_PAR_FUNC_COST 16
+#define MAT_PAR_MAX_TASKS 64
+
+// Entries are stored as dtype, fp32 unless set. MAT_AT and
+// the element-wise kernels only work on fp32 matrices while
+// products, copies and views take any dtype. Strides and
+// steps are counted in entries.
 typedef struct Matrix {
     MAT_TYPE *data, *free_ptr;
     size_t n, m, step, stride;
+    enum MAT_DTYPE dtype;
 } Mat;
 
+// Bump allocator of matrices. Every matrix starts at a
+// MAT_ALIGN byte boundary of one contiguous buffer, so
+// the matrices of an arena can also be seen as one flat
+// vector. Padding entries are always zero.
+#define MAT_ALIGN 64
+
+typedef struct Arena {
+    MAT_TYPE *data, *free_ptr;
+    size_t len, cap;
+} Arena;
+
 // Gives an entry point to specific data in the matrix.
 #define MAT_AT(mat, i, j) ((mat).data[(i)*(mat).stride + (j)*(mat).step])
 
@@ -28,25 +59,54 @@ typedef struct Matrix {
 
 void mat_assert(Mat m);
 Mat mat_new(size_t n, size_t m);
+Mat mat_new_as(size_t n, size_t m, enum MAT_DTYPE dtype);
 Mat mat_rand_new(size_t n, size_t m);
+Mat mat_rand(Mat m);
 Mat mat_fill(Mat m, double v);
+Mat mat_view(Mat m);
+MAT_TYPE *mat_ptr(Mat m, size_t i, size_t j);
+float mat_get(Mat m, size_t i, size_t j);
+void mat_set(Mat m, size_t i, size_t j, float v);
 Mat mat_row(Mat m, size_t i);
+Mat mat_rows(Mat m, size_t from, size_t to);
 Mat mat_col(Mat m, size_t j);
+Mat mat_cols(Mat m, size_t from, size_t to);
 Mat mat_sum(Mat a, Mat b);
+Mat mat_sum_col(Mat a, Mat b);
+Mat mat_reduce_cols(Mat dst, Mat a);
 double mat_add(Mat m);
+double mat_sum_sq(Mat m);
+double mat_softmax_xent(Mat dst, Mat z, Mat y);
+Mat mat_softmax(Mat m);
 Mat mat_scalar(Mat a, double v);
 Mat mat_sub(Mat a, Mat b);
 Mat mat_t(Mat m);
 Mat mat_dot(Mat dst, Mat a, Mat b);
 Mat mat_dot_sum(Mat dst, Mat a, Mat b);
+Mat mat_dense(Mat dst, Mat z, Mat w, Mat x, Mat b, enum ACT_FUNC act);
 Mat mat_mul(Mat a, Mat b);
 Mat mat_copy(Mat a, Mat b);
 Mat mat_func(Mat n, Mat m, double (*f)(double x));
+Mat mat_dot_par(ThreadPool *pool, Mat dst, Mat a, Mat b);
+Mat mat_dense_par(ThreadPool *pool, Mat dst, Mat z, Mat w, Mat x, Mat b, enum ACT_FUNC act);
+Mat mat_dot_sum_par(ThreadPool *pool, Mat dst, Mat a, Mat b);
+Mat mat_func_par(ThreadPool *pool, Mat n, Mat m, double (*f)(double x));
+Mat mat_sum_par(ThreadPool *pool, Mat a, Mat b);
+Mat mat_sub_par(ThreadPool *pool, Mat a, Mat b);
 Mat mat_from(FILE *f);
 size_t mat_argmax(Mat m);
 void mat_save(Mat m, FILE *f);
 void mat_del(Mat m);
 
+size_t arena_size(size_t n, size_t m);
+size_t arena_size_as(size_t n, size_t m, enum MAT_DTYPE dtype);
+Arena arena_new(size_t cap);
+Arena arena_view(MAT_TYPE *data, size_t cap);
+Mat mat_new_in(Arena *arena, size_t n, size_t m);
+Mat mat_new_in_as(Arena *arena, size_t n, size_t m, enum MAT_DTYPE dtype);
+Mat arena_mat(Arena arena);
+void arena_del(Arena arena);
+
 void mat_print_with_str(Mat m, const char *str, int pad);
 void mat_print_no_nl(Mat m, const char *str);
 void mat_print_from_layer(Mat m, size_t i);
@@ -4,10 +4,20 @@
 #include "layer.h"
 #include "set.h"
 #include "matrix.h"
+#include "threadpool.h"
+#include "stream.h"
+#include "batch.h"
+#include "quant.h"
+#include "optim.h"
 #include <assert.h>
 #include <time.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 // Architecture of the neural network.
 size_t ARCH[] = { 4, 5, 5, 3 };
@@ -20,11 +30,156 @@ size_t MAX_EPOCHS = 10e+4;
 double MIN_ERROR = 10e-5;
 size_t BATCH_SIZE = 10;
 
+// Update rule. MOMENTUM keeps a BETA1 average of the gradients,
+// RMSPROP divides them by the root of a BETA2 average of their
+// squares and ADAM does both. The adaptive ones usually need a
+// LEARNING_RATE around 10e-3.
+enum OPTIMIZER OPTIMIZER = SGD;
+double BETA1 = 0.9;
+double BETA2 = 0.999;
+double EPSILON = 10e-8;
+
+// Evaluation. The cost reported every epoch is the mean loss
+// of the training forwards, each batch measured right before
+// its update. Every EVAL_EVERY epochs (0 never) a full forward
+// measures the loss on EVAL_SAMPLES random samples (0 all of
+// them). When EVAL_SPLIT > 0 they're taken from that fraction
+// of the set, picked at random once before training and held
+// out of it, and EVAL_EVERY = 0 evaluates every epoch. When
+// evaluations run, MIN_ERROR is checked against the last one.
+// Evaluations are forwarded in batches of EVAL_BATCH samples.
+size_t EVAL_EVERY = 0;
+size_t EVAL_SAMPLES = 0;
+double EVAL_SPLIT = 0;
+size_t EVAL_BATCH = 256;
+
+// Early stopping. Training stops after PATIENCE evaluations in a
+// row (0 never) that don't improve the best one by more than
+// MIN_DELTA. With KEEP_BEST the parameters of the best evaluation
+// are kept in memory and restored when training ends.
+size_t PATIENCE = 0;
+double MIN_DELTA = 0;
+bool KEEP_BEST = true;
+
+// Parallelism, THREADS = 0 uses every online core.
+size_t THREADS = 0;
+size_t MIN_THREAD_SAMPLES = 8;
+
+// Profiling. With PROFILE every phase of training is timed
+// with the monotonic clock and the FLOPs and bytes of every
+// layer are counted in NN_STATS. With a PROFILE_LOG path a
+// line per epoch is written to it, JSON lines when the path
+// ends in .json and CSV otherwise.
+bool PROFILE = false;
+const char *PROFILE_LOG = NULL;
+
+// The weights and biases of every layer are taken from one
+// arena, params, and the activations from another, acts, so
+// the parameters of the network are also one flat vector.
 typedef struct NeuralNetwork {
     size_t xs, len;
     Layer *l;
+    Arena *params, *acts;
+    void *map;
+    size_t map_len;
 } NN;
 
+// Activations of the forwards of a network, owned by the
+// caller. Predicting through a workspace only reads the
+// network, so threads sharing one NN can predict at once,
+// each with a workspace of its own.
+typedef struct NNWorkspace {
+    Arena acts;
+    Mat *a;
+    size_t len, cols;
+} NNWorkspace;
+
+// Model file v2. A 64 byte header, a table with one entry
+// per layer and the weights and biases of every layer, each
+// one at a 64 byte aligned offset so the file can be mapped
+// and its weights used in place.
+#define NN_MAGIC "NNMODEL\0"
+#define NN_VERSION 2
+#define NN_ENDIAN 0x01020304u
+#define NN_ALIGN 64
+
+typedef struct NNHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t endian;
+    uint64_t xs, len;
+    uint64_t table;
+    uint64_t size;
+    uint8_t reserved[16];
+} NNHeader;
+
+typedef struct NNLayerEntry {
+    uint32_t act;
+    uint32_t dtype;
+    uint64_t n, m;
+    uint64_t w, b;
+    uint8_t reserved[24];
+} NNLayerEntry;
+
+_Static_assert(sizeof(NNHeader) == NN_ALIGN, "NNHeader must be 64 bytes");
+_Static_assert(sizeof(NNLayerEntry) == NN_ALIGN, "NNLayerEntry must be 64 bytes");
+
+// Phases of training. SHUFFLE also takes the time spent
+// waiting on the next chunk of a stream, FORWARD and BACKWARD
+// add up the time of every worker, so with many threads they
+// can take longer than the training itself.
+enum NN_PHASE {
+    PHASE_SHUFFLE,
+    PHASE_SLICE,
+    PHASE_FORWARD,
+    PHASE_BACKWARD,
+    PHASE_UPDATE,
+    PHASE_EVAL,
+    NN_PHASES,
+};
+
+const char *NN_PHASE_NAMES[] = { "shuffle", "slice", "forward", "backward", "update", "eval" };
+
+// Work of a layer. FLOPs count the products, biases and
+// activations, bytes the weights, inputs and outputs each
+// read or written once per batch, a lower bound of the
+// traffic of every kernel.
+typedef struct NNLayerStats {
+    double flops, bytes;
+} NNLayerStats;
+
+// Counters of the last training run, filled when PROFILE is set.
+typedef struct NNStats {
+    size_t epochs, batches, samples;
+    double secs[NN_PHASES];
+    double wall, flops, bytes;
+    size_t len;
+    NNLayerStats *l;
+} NNStats;
+
+NNStats NN_STATS;
+
+// A training worker. It shares the weights of the network
+// being trained but owns its activations and gradients.
+// fwd and bwd add up the seconds it spent in each half
+// of backpropagation while profiling.
+typedef struct Worker {
+    NN n, g;
+    Mat x, y;
+    double loss;
+    double fwd, bwd;
+} Worker;
+
+// Workers every batch is split between, the calling
+// thread works as the first one.
+typedef struct Trainer {
+    Worker *w;
+    size_t workers;
+    ThreadPool *pool;
+    Optim *opt;
+    Batcher *batches, *evals;
+} Trainer;
+
 // Converts the matrix into a Set.
 Set mat_to_set(Mat m) {
     return (Set) {
@@ -33,6 +188,7 @@ Set mat_to_set(Mat m) {
         .n = m.n,
         .m = m.m,
         .stride = m.stride,
+        .dtype = m.dtype,
     };
 }
 
@@ -45,35 +201,120 @@ Mat set_to_mat(Set s) {
         .m = s.m,
         .step = 1,
         .stride = s.stride,
+        .dtype = s.dtype,
     };
 }
 
+// Returns an empty nn with the given amount of layers.
+NN static new_nn_with(size_t xs, size_t len) {
+    NN n = (NN) {
+        .xs = xs,
+        .len = len,
+        .l = calloc(len, sizeof(Layer)),
+        .params = calloc(2, sizeof(Arena)),
+    };
+
+    assert(n.l != NULL);
+    assert(n.params != NULL);
+    n.acts = n.params + 1;
+    return n;
+}
+
+// Returns the dtype the activations of the i'th layer
+// are stored as. Hidden layers take the dtype of their
+// weights, the outputs are always fp32.
+enum MAT_DTYPE static nn_act_dtype(NN n, size_t i) {
+    return i + 1 < n.len ? n.l[i].w.dtype : MAT_F32;
+}
+
+// Grows the activations of every layer so
+// a batch of `cols` samples can be forwarded.
+// All of them are taken from one arena.
+void nn_reserve(NN n, size_t cols) {
+    if (n.acts->data && n.l[0].z.m >= cols) return;
+
+    size_t size = 0;
+    for (size_t i = 0; i < n.len; i++)
+        size += arena_size(n.l[i].w.n, cols)
+              + arena_size_as(n.l[i].w.n, cols, nn_act_dtype(n, i));
+
+    arena_del(*n.acts);
+    *n.acts = arena_new(size);
+    for (size_t i = 0; i < n.len; i++) {
+        Layer *l = &n.l[i];
+        mat_del(l->z);
+        mat_del(l->a);
+        l->z = mat_new_in(n.acts, l->w.n, cols);
+        l->a = mat_new_in_as(n.acts, l->w.n, cols, nn_act_dtype(n, i));
+    }
+}
+
 // arch: an array of [params, [hidden layers], outputs]
 NN nn_new(size_t arch[], enum ACT_FUNC *f, size_t len) {
     assert(len > 1);
     assert(f != NULL);
-    NN n = (NN) {
-        .l = malloc(sizeof(*n.l) * (len-1)),
-        .xs = arch[0],
-        .len = len-1,
-    };
+    NN n = new_nn_with(arch[0], len-1);
+
+    size_t size = 0;
+    for (size_t i = 0; i < len-1; i++)
+        size += arena_size(arch[i+1], arch[i]) + arena_size(arch[i+1], 1);
+    *n.params = arena_new(size);
 
-    assert(n.l != NULL);
-    size_t input_size = arch[0];
     for (size_t i = 0; i < len-1; i++) {
-        n.l[i] = lay_new(arch[i+1], input_size, f[i]);
-        lay_assert(n.l[i]);
-        input_size = arch[i+1];
+        assert(f[i] != SOFTMAX || i == len-2);
+        n.l[i] = lay_new_in(n.params, arch[i+1], arch[i], f[i]);
+        mat_rand(n.l[i].w);
+        mat_rand(n.l[i].b);
     }
 
+    nn_reserve(n, 1);
     return n;
 }
 
+// Returns a nn shaped like n whose weights and biases are
+// taken from params, with room for as many activations.
+NN static new_nn_like(NN n, Arena params) {
+    NN r = new_nn_with(n.xs, n.len);
+    *r.params = params;
+    for (size_t i = 0; i < n.len; i++)
+        r.l[i] = lay_new_in_as(r.params, n.l[i].w.n, n.l[i].w.m,
+                               n.l[i].act_func, n.l[i].w.dtype);
+
+    nn_reserve(r, n.l[0].z.m);
+    return r;
+}
+
+// Returns a copy of n whose weights are stored as dtype,
+// accumulating in fp32 when forwarded. Biases, z and the
+// outputs stay fp32. bf16 and fp16 networks halve the
+// bytes read per weight but are meant for inference,
+// only fp32 networks can be trained.
+NN nn_as(NN n, enum MAT_DTYPE dtype) {
+    size_t size = 0;
+    for (size_t i = 0; i < n.len; i++)
+        size += arena_size_as(n.l[i].w.n, n.l[i].w.m, dtype) + arena_size(n.l[i].b.n, 1);
+
+    NN r = new_nn_with(n.xs, n.len);
+    *r.params = arena_new(size);
+    for (size_t i = 0; i < n.len; i++) {
+        r.l[i] = lay_new_in_as(r.params, n.l[i].w.n, n.l[i].w.m, n.l[i].act_func, dtype);
+        mat_copy(r.l[i].w, n.l[i].w);
+        mat_copy(r.l[i].b, n.l[i].b);
+    }
+
+    nn_reserve(r, n.l[0].z.m);
+    return r;
+}
+
 // Frees the memory used by the nn.
 void nn_del(NN n) {
     for (size_t i = 0; i < n.len; i++)
         lay_del(n.l[i]);
     free(n.l);
+    arena_del(*n.params);
+    arena_del(*n.acts);
+    free(n.params);
+    if (n.map) munmap(n.map, n.map_len);
 }
 
 // Prints the matrices of the nn.
@@ -83,118 +324,741 @@ void nn_print(NN n) {
         lay_print(n.l[i], i, n.l[i].w.m);
 }
 
-// Forwards the input values through the network.
-Mat static forward_rec(Layer *l, Mat x, size_t n, size_t i) {
+// Forwards the input values through the network. Only the
+// activations are kept, backpropagation doesn't need z.
+Mat static forward_rec(ThreadPool *pool, Layer *l, Mat x, size_t n, size_t i) {
     if (i == n) return x;
-    return forward_rec(l, lay_forward(l[i], x), n, i+1);
+    return forward_rec(pool, l, lay_forward_par(pool, l[i], x, false), n, i+1);
 }
 
 Mat static forward(NN n, Mat x) {
-    return forward_rec(n.l, x, n.len, 0);
+    return forward_rec(NULL, n.l, x, n.len, 0);
+}
+
+// Returns whether the outputs of n go through a softmax,
+// which makes cross entropy the loss it is trained with.
+bool static nn_softmax(NN n) {
+    return n.l[n.len-1].act_func == SOFTMAX;
+}
+
+// Forwards x leaving the softmax out, the activations of
+// the output layer end up holding its logits.
+Mat static forward_logits(NN n, Mat x) {
+    Layer out = n.l[n.len-1];
+    Mat prev = forward_rec(NULL, n.l, x, n.len-1, 0);
+    return mat_dense(mat_cols(out.a, 0, x.m), (Mat) {0}, out.w, prev, out.b, LINEAL);
+}
+
+// Returns the Matrix of predicted values given x,
+// splitting the kernels of wide layers between the
+// workers of pool. Meant for big single requests.
+// The result lives in the activations of n, so it is
+// overwritten by the next forward and n can't be
+// forwarded by two threads at once, see nn_predict().
+Mat nn_forward_par(NN n, ThreadPool *pool, Set x) {
+    nn_reserve(n, x.n);
+    return forward_rec(pool, n.l, mat_t(set_to_mat(x)), n.len, 0);
 }
 
 // Returns the Matrix of predicted values given x.
 Mat nn_forward(NN n, Set x) {
-    return forward(n, mat_t(set_to_mat(x)));
+    return nn_forward_par(n, NULL, x);
 }
 
-// Returns a new neural network filled with zeros.
-NN static new_nn_zero(NN n) {
-    NN g = (NN) {
-        .l = malloc(sizeof(*g.l) * n.len),
-        .xs = n.xs,
+// Grows ws so a batch of `cols` samples can be
+// predicted with n. Only the activations of every
+// layer are kept, stored like the ones of n.
+void nn_workspace_reserve(NN n, NNWorkspace *ws, size_t cols) {
+    assert(ws->len == n.len);
+    if (ws->acts.data && ws->cols >= cols) return;
+
+    size_t size = 0;
+    for (size_t i = 0; i < n.len; i++)
+        size += arena_size_as(n.l[i].w.n, cols, nn_act_dtype(n, i));
+
+    arena_del(ws->acts);
+    ws->acts = arena_new(size);
+    ws->cols = cols;
+    for (size_t i = 0; i < n.len; i++)
+        ws->a[i] = mat_new_in_as(&ws->acts, n.l[i].w.n, cols, nn_act_dtype(n, i));
+}
+
+// Returns a workspace to predict with n batches
+// of up to `cols` samples.
+NNWorkspace nn_workspace_new(NN n, size_t cols) {
+    NNWorkspace ws = {
+        .a = calloc(n.len, sizeof(Mat)),
         .len = n.len,
     };
 
-    assert(g.l != NULL);
-    for (size_t i = 0; i < n.len; i++)
-        g.l[i] = lay_new_zero(n.l[i]);
+    assert(ws.a != NULL);
+    nn_workspace_reserve(n, &ws, cols);
+    return ws;
+}
 
-    return g;
+// Frees the memory used by the workspace.
+void nn_workspace_del(NNWorkspace ws) {
+    arena_del(ws.acts);
+    free(ws.a);
 }
 
-// Fills the matrices with zeros.
-void static fill_nn_zeros(NN n) {
-    for (size_t l = 0; l < n.len; l++)
-        lay_fill_zeros(n.l[l]);
+// Returns the Matrix of predicted values given x, one
+// col per sample. Only the weights of n are read, the
+// result lives in ws until its next prediction.
+Mat nn_predict_batch(NN n, NNWorkspace *ws, Set x) {
+    assert(x.m == n.xs);
+    nn_workspace_reserve(n, ws, x.n);
+    Mat a = mat_t(set_to_mat(x));
+    for (size_t i = 0; i < n.len; i++) {
+        Layer l = n.l[i];
+        a = mat_dense(mat_cols(ws->a[i], 0, x.n), (Mat) {0}, l.w, a, l.b, l.act_func);
+    }
+
+    return a;
+}
+
+// Predicts the n.xs inputs of one sample in `in` and stores
+// its outputs in out. Reentrant, any amount of threads can
+// predict with n at once as long as each has its own ws.
+void nn_predict(NN n, NNWorkspace *ws, const float *in, float *out) {
+    Set x = {
+        .data = (MAT_TYPE *) in,
+        .n = 1,
+        .m = n.xs,
+        .stride = n.xs,
+        .dtype = MAT_F32,
+    };
+
+    Mat y = nn_predict_batch(n, ws, x);
+    for (size_t i = 0; i < y.n; i++)
+        out[i] = MAT_AT(y, i, 0);
+}
+
+// Returns a new neural network filled with zeros. Its
+// parameters are laid out like the ones of n, so both
+// can be seen as parallel flat vectors.
+NN static new_nn_zero(NN n) {
+    return new_nn_like(n, arena_new(n.params->len));
+}
+
+// Returns the summed squared error of the network
+// over the samples of x. They are forwarded in batches
+// as big as the activations of the network allow.
+double static sq_error(NN n, Mat x, Mat y) {
+    size_t cap = n.l[0].z.m;
+    double sum = 0;
+
+    for (size_t i = 0; i < y.m; i += cap) {
+        size_t to = i + cap < y.m ? i + cap : y.m;
+        Mat pred = forward(n, mat_cols(x, i, to));
+        sum += mat_sum_sq(mat_sub(pred, mat_cols(y, i, to)));
+    }
+
+    return sum;
 }
 
 // Calculates the loss of the network
 // using Mean Squared Error.
 double mse(NN n, Mat x, Mat y) {
-    size_t len = y.m;
-    Mat errors;
-    MAT_ON_STACK(errors, len, 1);
+    return sq_error(n, x, y) / y.m;
+}
 
-    for (size_t i = 0; i < len; i++) {
-        Mat pred = forward(n, mat_col(x, i));
-        Mat diff = mat_sub(pred, mat_col(y, i));
-        MAT_AT(errors, i, 0) = mat_add(mat_mul(diff, diff));
+// Returns the summed cross entropy of a network with a
+// softmax output over the samples of x, taken from the
+// logits so no probability is rounded to 0.
+double static xent_error(NN n, Mat x, Mat y) {
+    assert(nn_softmax(n));
+    size_t cap = n.l[0].z.m;
+    double sum = 0;
+
+    for (size_t i = 0; i < y.m; i += cap) {
+        size_t to = i + cap < y.m ? i + cap : y.m;
+        Mat logits = forward_logits(n, mat_cols(x, i, to));
+        sum += mat_softmax_xent((Mat) {0}, logits, mat_cols(y, i, to));
+    }
+
+    return sum;
+}
+
+// Calculates the loss of a network with a softmax
+// output using Cross Entropy.
+double cross_entropy(NN n, Mat x, Mat y) {
+    return xent_error(n, x, y) / y.m;
+}
+
+// Returns the summed loss the network is trained with.
+double static loss_sum(NN n, Mat x, Mat y) {
+    return nn_softmax(n) ? xent_error(n, x, y) : sq_error(n, x, y);
+}
+
+// Forward half of backpropagation. Stores the gradient of the
+// loss with respect to the outputs in the z of the last layer
+// of g, which is scratch space, and returns the summed loss.
+double static backprop_forward(NN n, NN g, Mat x, Mat y) {
+    size_t len = x.m;
+    bool xent = nn_softmax(n);
+    // The error goes to scratch space, the derivative
+    // of the last layer still needs its activations.
+    Mat diff = mat_cols(g.l[n.len-1].z, 0, len);
+    double loss;
+    if (xent) {
+        // The gradient of the cross entropy with respect to
+        // the logits is softmax(z) - y, so the last layer
+        // skips the derivative of its activation.
+        loss = mat_softmax_xent(diff, forward_logits(n, x), y);
+    } else {
+        mat_sub(mat_copy(diff, forward(n, x)), y);
+        loss = mat_sum_sq(diff);
+        mat_scalar(diff, 2);
+    }
+
+    return loss;
+}
+
+// Backward half of backpropagation. Propagates the gradient
+// left by backprop_forward() and stores the summed gradients
+// of the weights and biases in g.
+void static backprop_backward(NN n, NN g, Mat x) {
+    size_t len = x.m;
+    bool xent = nn_softmax(n);
+    Mat diff = mat_cols(g.l[n.len-1].z, 0, len);
+
+    for (long l = n.len-1; l >= 0; l--) {
+        Layer curr = n.l[l];
+        Layer grad = g.l[l];
+        Mat a = mat_cols(curr.a, 0, len);
+        Mat post_delta = xent && l == (long) n.len-1 ? diff
+                       : mat_mul(diff, lay_der(curr, mat_cols(grad.a, 0, len), a));
+        Mat prev_a = l > 0 ? mat_cols(n.l[l-1].a, 0, len) : x;
+
+        // dJdW
+        mat_dot(grad.w, post_delta, mat_t(prev_a));
+        // dJdB
+        mat_reduce_cols(grad.b, post_delta);
+        if (l > 0) diff = mat_dot(mat_cols(g.l[l-1].z, 0, len), mat_t(curr.w), post_delta);
+    }
+}
+
+// Returns the time of the monotonic clock in
+// seconds while profiling, 0 otherwise.
+double static prof_now() {
+    if (!PROFILE) return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Adds the time since start to phase.
+void static prof_add(enum NN_PHASE phase, double start) {
+    if (PROFILE) NN_STATS.secs[phase] += prof_now() - start;
+}
+
+// Counts the work of forwarding a batch of cols samples
+// through every layer of n and, when train is set, of
+// propagating it back. Only the first layer skips the
+// product that passes the gradient to its inputs.
+void static prof_layers(NN n, size_t cols, bool train) {
+    if (!PROFILE) return;
+    for (size_t i = 0; i < n.len; i++) {
+        Mat w = n.l[i].w;
+        double weights = (double) w.n * w.m;
+        double flops = 2 * weights * cols + 2.0 * w.n * cols;
+        double bytes = weights * dtype_size(w.dtype) + sizeof(float) * (w.n + (w.m + w.n) * cols);
+        if (train) {
+            flops += (i > 0 ? 4 : 2) * weights * cols + 2.0 * w.n * cols;
+            bytes += weights * (2 * sizeof(float) + dtype_size(w.dtype))
+                   + sizeof(float) * (w.n + (w.m + 2 * w.n) * cols);
+        }
+
+        NN_STATS.l[i].flops += flops;
+        NN_STATS.l[i].bytes += bytes;
+        NN_STATS.flops += flops;
+        NN_STATS.bytes += bytes;
+    }
+}
+
+// State of the profiler along a training run: the per epoch
+// log, when the run started and the counters at the start
+// of the current epoch.
+typedef struct Profile {
+    FILE *log;
+    bool json;
+    double start;
+    NNStats epoch;
+} Profile;
+
+// Resets NN_STATS for a training run of n and opens PROFILE_LOG.
+Profile static prof_begin(NN n) {
+    Profile p = {0};
+    if (!PROFILE) return p;
+
+    free(NN_STATS.l);
+    NN_STATS = (NNStats) {
+        .len = n.len,
+        .l = calloc(n.len, sizeof(NNLayerStats)),
+    };
+
+    assert(NN_STATS.l != NULL);
+    p.start = prof_now();
+    p.epoch = NN_STATS;
+    if (!PROFILE_LOG) return p;
+
+    p.log = fopen(PROFILE_LOG, "w");
+    if (!p.log) {
+        perror("Error opening profile log");
+        exit(1);
+    }
+
+    size_t len = strlen(PROFILE_LOG);
+    p.json = len >= 5 && strcmp(PROFILE_LOG + len - 5, ".json") == 0;
+    if (!p.json) {
+        fprintf(p.log, "epoch,cost,eval,secs");
+        for (size_t i = 0; i < NN_PHASES; i++)
+            fprintf(p.log, ",%s_secs", NN_PHASE_NAMES[i]);
+        fprintf(p.log, ",gflops,gbytes\n");
+    }
+    return p;
+}
+
+// Closes an epoch, logging what it took. eval is NAN
+// when the epoch ended without an evaluation.
+void static prof_epoch(Profile *p, size_t epoch, double cost, double eval) {
+    if (!PROFILE) return;
+    NN_STATS.epochs = epoch + 1;
+    NN_STATS.wall = prof_now() - p->start;
+    NNStats last = p->epoch;
+    p->epoch = NN_STATS;
+    if (!p->log) return;
+
+    double secs = NN_STATS.wall - last.wall;
+    double gflops = (NN_STATS.flops - last.flops) * 1e-9;
+    double gbytes = (NN_STATS.bytes - last.bytes) * 1e-9;
+    if (p->json) {
+        fprintf(p->log, "{\"epoch\": %zu, \"cost\": %.9g, \"eval\": ", epoch, cost);
+        fprintf(p->log, isnan(eval) ? "null" : "%.9g", eval);
+        fprintf(p->log, ", \"secs\": {\"total\": %.9g", secs);
+        for (size_t i = 0; i < NN_PHASES; i++)
+            fprintf(p->log, ", \"%s\": %.9g", NN_PHASE_NAMES[i], NN_STATS.secs[i] - last.secs[i]);
+        fprintf(p->log, "}, \"gflops\": %.9g, \"gbytes\": %.9g}\n", gflops, gbytes);
+    } else {
+        fprintf(p->log, "%zu,%.9g,", epoch, cost);
+        if (!isnan(eval)) fprintf(p->log, "%.9g", eval);
+        fprintf(p->log, ",%.9g", secs);
+        for (size_t i = 0; i < NN_PHASES; i++)
+            fprintf(p->log, ",%.9g", NN_STATS.secs[i] - last.secs[i]);
+        fprintf(p->log, ",%.9g,%.9g\n", gflops, gbytes);
+    }
+}
+
+void static prof_end(Profile p) {
+    if (p.log) fclose(p.log);
+}
+
+// Prints where the time of the last training run went
+// and the work done by every layer.
+void nn_stats_print(NNStats s) {
+    printf("%zu epochs, %zu batches, %zu samples in %.3lf s\n",
+           s.epochs, s.batches, s.samples, s.wall);
+    for (size_t i = 0; i < NN_PHASES; i++)
+        printf("  %-9s %10.3lf s %6.1lf%%\n", NN_PHASE_NAMES[i], s.secs[i],
+               s.wall > 0 ? s.secs[i] / s.wall * 100 : 0);
+
+    for (size_t i = 0; i < s.len; i++)
+        printf("  layer %zu: %10.3lf GFLOP %10.3lf GB\n", i, s.l[i].flops * 1e-9, s.l[i].bytes * 1e-9);
+    printf("  %.3lf GFLOP/s, %.3lf GB/s\n",
+           s.wall > 0 ? s.flops / s.wall * 1e-9 : 0,
+           s.wall > 0 ? s.bytes / s.wall * 1e-9 : 0);
+}
+
+// Applies the gradients of a batch of len samples in
+// one pass over the flat parameter vector and the
+// state of the optimizer, laid out like it.
+void static gradient_descent(NN n, NN g, Optim *opt, size_t len) {
+    optim_step(opt, n.params->data, g.params->data, 1.0 / len);
+}
+
+// Returns a network sharing the weights and biases
+// of n with its own activations.
+NN static new_nn_shadow(NN n) {
+    return new_nn_like(n, arena_view(n.params->data, n.params->len));
+}
+
+// Amount of workers nn_fit splits every batch into.
+size_t static fit_workers() {
+    if (THREADS > 0) return THREADS;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? cores : 1;
+}
+
+// Creates the workers that train n.
+Trainer static trainer_new(NN n) {
+    for (size_t i = 0; i < n.len; i++)
+        assert(n.l[i].w.dtype == MAT_F32);
+
+    // The weights of mapped networks are read-only, train
+    // a copy loaded with nn_from() instead.
+    assert(n.map == NULL);
+
+    nn_reserve(n, BATCH_SIZE);
+    Trainer t = {
+        .workers = fit_workers(),
+        .opt = malloc(sizeof(Optim)),
+    };
+
+    assert(t.opt != NULL);
+    *t.opt = optim_new(OPTIMIZER, n.params->len, LEARNING_RATE, BETA1, BETA2, EPSILON);
+
+    t.w = calloc(t.workers, sizeof(*t.w));
+    assert(t.w != NULL);
+    for (size_t i = 0; i < t.workers; i++) {
+        t.w[i].n = new_nn_shadow(n);
+        t.w[i].g = new_nn_zero(n);
+        nn_reserve(t.w[i].n, EVAL_BATCH);
     }
 
-    return mat_add(errors) / len;
+    t.pool = t.workers > 1 ? thpool_new(t.workers - 1) : NULL;
+    t.batches = batcher_new(n.xs, n.l[n.len-1].w.n, BATCH_SIZE);
+    t.evals = batcher_new(n.xs, n.l[n.len-1].w.n, EVAL_BATCH * t.workers);
+    return t;
 }
 
-// Backpropagation algorithm for neural network learning.
-void static backpropagation(NN n, NN g, Mat x, Mat y) {
-    fill_nn_zeros(g);
+// Frees the workers of t.
+void static trainer_del(Trainer t) {
+    batcher_del(t.batches);
+    batcher_del(t.evals);
+    thpool_del(t.pool);
+    for (size_t i = 0; i < t.workers; i++) {
+        nn_del(t.w[i].n);
+        nn_del(t.w[i].g);
+    }
+
+    free(t.w);
+    optim_del(*t.opt);
+    free(t.opt);
+}
+
+void static worker_job(void *arg) {
+    Worker *w = arg;
+    double start = prof_now();
+    w->loss = backprop_forward(w->n, w->g, w->x, w->y);
+    double mid = prof_now();
+    backprop_backward(w->n, w->g, w->x);
+    w->fwd += mid - start;
+    w->bwd += prof_now() - mid;
+}
+
+void static eval_job(void *arg) {
+    Worker *w = arg;
+    w->loss = loss_sum(w->n, w->x, w->y);
+}
+
+// Splits the samples in slices of at least MIN_THREAD_SAMPLES
+// samples, one per worker, and runs job on every worker with
+// its slice. Returns the amount of workers used.
+size_t static trainer_run(Trainer t, Mat x, Mat y, Job job) {
+    Worker *w = t.w;
     size_t len = x.m;
-    for (size_t s = 0; s < len; s++) {
-        Mat inp = mat_col(x, s);
-        Mat out = forward(n, inp);
-        Mat rvs = mat_col(y, s);
-        Mat diff = mat_scalar(mat_sub(out, rvs), 2);
-
-        for (long l = n.len-1; l >= 0; l--) {
-            Layer curr = n.l[l];
-            Layer grad = g.l[l];
-            Mat post_delta = mat_mul(diff, lay_der(curr, grad.a, curr.z));
-            Mat prev_a = l > 0 ? n.l[l-1].a : inp;
-            Mat prev_z = l > 0 ? g.l[l-1].z : (Mat) {0};
-
-            // dJdW
-            mat_dot_sum(grad.w, post_delta, mat_t(prev_a));
-            // dJdB
-            mat_sum(grad.b, post_delta);
-            if (l > 0) diff = mat_dot(prev_z, mat_t(curr.w), post_delta);
+    size_t k = (len + MIN_THREAD_SAMPLES - 1) / MIN_THREAD_SAMPLES;
+    k = k < t.workers ? k : t.workers;
+    k = k > 0 ? k : 1;
+    size_t slice = (len + k - 1) / k;
+    k = (len + slice - 1) / slice;
+
+    Join join;
+    thpool_join_init(&join);
+    for (size_t i = 0; i < k; i++) {
+        size_t from = i * slice;
+        size_t to = from + slice < len ? from + slice : len;
+        w[i].x = mat_cols(x, from, to);
+        w[i].y = mat_cols(y, from, to);
+        if (i > 0 && thpool_spawn_join(t.pool, &join, job, &w[i]))
+            job(&w[i]);
+    }
+
+    job(&w[0]);
+    thpool_join(t.pool, &join);
+    return k;
+}
+
+// Trains n with one batch split between the workers. The
+// gradients and losses of every slice are summed in worker
+// order before updating the network, so the result doesn't
+// depend on how the pool schedules them.
+// Returns the summed squared error of the batch.
+double static fit_batch(NN n, Trainer t, Mat x, Mat y) {
+    Worker *w = t.w;
+    size_t k = trainer_run(t, x, y, worker_job);
+    double start = prof_now();
+    double loss = w[0].loss;
+
+    for (size_t i = 1; i < k; i++) {
+        mat_sum(arena_mat(*w[0].g.params), arena_mat(*w[i].g.params));
+        loss += w[i].loss;
+    }
+
+    gradient_descent(n, w[0].g, t.opt, x.m);
+    prof_add(PHASE_UPDATE, start);
+    if (PROFILE) {
+        for (size_t i = 0; i < k; i++) {
+            NN_STATS.secs[PHASE_FORWARD] += w[i].fwd;
+            NN_STATS.secs[PHASE_BACKWARD] += w[i].bwd;
+            w[i].fwd = w[i].bwd = 0;
         }
+
+        NN_STATS.batches++;
+        NN_STATS.samples += x.m;
+        prof_layers(n, x.m, true);
+    }
+    return loss;
+}
+
+// Runs one pass of minibatches over the rows t.batches
+// visits, in a new random order when shuffle is set.
+// Every batch is packed while the one before it trains.
+// Returns the summed squared error of every batch.
+double static fit_pass(NN n, Trainer t, bool shuffle) {
+    double start = prof_now();
+    batcher_pass(t.batches, t.batches->len, shuffle);
+    prof_add(PHASE_SHUFFLE, start);
+
+    double loss = 0;
+    Mat x_batch, y_batch;
+    start = prof_now();
+    while (batcher_next(t.batches, &x_batch, &y_batch)) {
+        prof_add(PHASE_SLICE, start);
+        loss += fit_batch(n, t, x_batch, y_batch);
+        start = prof_now();
     }
 
-    for (size_t l = 0; l < n.len; l++) {
-        mat_sub(n.l[l].w, mat_scalar(g.l[l].w, LEARNING_RATE / len));
-        mat_sub(n.l[l].b, mat_scalar(g.l[l].b, LEARNING_RATE / len));
+    return loss;
+}
+
+// Returns the summed squared error of the network being
+// trained over len of the rows t.evals visits, random
+// ones with shuffle, forwarded by every worker.
+double static eval_pass(NN n, Trainer t, size_t len, bool shuffle) {
+    double start = prof_now();
+    batcher_pass(t.evals, len, shuffle);
+    prof_add(PHASE_SHUFFLE, start);
+
+    double loss = 0;
+    Mat x, y;
+    start = prof_now();
+    while (batcher_next(t.evals, &x, &y)) {
+        size_t k = trainer_run(t, x, y, eval_job);
+        for (size_t i = 0; i < k; i++)
+            loss += t.w[i].loss;
     }
+
+    prof_add(PHASE_EVAL, start);
+    prof_layers(n, len, false);
+    return loss;
+}
+
+// True when the epoch-th epoch ends with an evaluation,
+// which happens every `every` epochs (0 never).
+bool static eval_epoch(size_t every, size_t epoch) {
+    return every > 0 && (epoch + 1) % every == 0;
 }
 
-// Trains the network with the given set.
+// Best evaluation of a training run, the epoch it happened
+// at and, with KEEP_BEST, a copy of the parameters that
+// reached it.
+typedef struct Checkpoint {
+    double best;
+    size_t epoch, bad;
+    Arena params;
+    bool saved;
+} Checkpoint;
+
+Checkpoint static checkpoint_new(NN n) {
+    return (Checkpoint) {
+        .best = INFINITY,
+        .params = KEEP_BEST ? arena_new(n.params->len) : (Arena) {0},
+    };
+}
+
+// Records the evaluation of an epoch, copying the parameters
+// aside when it's the best one so far. Returns true when
+// PATIENCE evaluations in a row didn't improve it.
+bool static checkpoint_update(Checkpoint *c, NN n, size_t epoch, double eval) {
+    if (eval < c->best - MIN_DELTA) {
+        c->best = eval;
+        c->epoch = epoch;
+        c->bad = 0;
+        if (KEEP_BEST) {
+            memcpy(c->params.data, n.params->data, n.params->len * sizeof(MAT_TYPE));
+            c->saved = true;
+        }
+        return false;
+    }
+
+    return PATIENCE > 0 && ++c->bad >= PATIENCE;
+}
+
+// Restores the best parameters into n, if any were kept.
+void static checkpoint_restore(Checkpoint c, NN n) {
+    if (c.saved) {
+        memcpy(n.params->data, c.params.data, n.params->len * sizeof(MAT_TYPE));
+        printf("best: %li: eval = %lf\n", c.epoch, c.best);
+    }
+
+    arena_del(c.params);
+}
+
+// Rows of an fp32 set visited by training or evaluation,
+// the first len ones when idx is NULL.
+typedef struct SetRows {
+    Set set;
+    const size_t *idx;
+    size_t len;
+} SetRows;
+
+// Trains the network with the rows of train, evaluating it
+// every `every` epochs on EVAL_SAMPLES random rows of test
+// (0 all of them). Both are visited through permutations
+// of their indices, so no row is moved. test may be train.
+// Returns the amount of epochs ran.
+size_t static fit_sets(NN n, SetRows train, SetRows test, size_t every) {
+    size_t epochs = 0;
+    double c, eval = INFINITY;
+    bool stop = false;
+    Trainer t = trainer_new(n);
+    Checkpoint best = checkpoint_new(n);
+    Profile prof = prof_begin(n);
+    size_t samples = EVAL_SAMPLES > 0 && EVAL_SAMPLES < test.len ? EVAL_SAMPLES : test.len;
+
+    // Without samples to evaluate, training is checked
+    // against MIN_ERROR with its own cost.
+    every = samples > 0 ? every : 0;
+    batcher_set(t.batches, train.set, train.idx, train.len);
+    batcher_set(t.evals, test.set, test.idx, test.len);
+
+    do {
+        c = train.len > 0 ? fit_pass(n, t, true) / train.len : 0;
+        printf("%li: cost = %lf", epochs, c);
+
+        bool evaluated = eval_epoch(every, epochs);
+        if (evaluated) {
+            eval = eval_pass(n, t, samples, samples < test.len) / samples;
+            stop = checkpoint_update(&best, n, epochs, eval);
+            printf(", eval = %lf", eval);
+        }
+
+        puts("");
+        prof_epoch(&prof, epochs, c, evaluated ? eval : NAN);
+    } while ((every > 0 ? eval : c) > MIN_ERROR && !stop && ++epochs < MAX_EPOCHS);
+
+    prof_end(prof);
+    checkpoint_restore(best, n);
+    trainer_del(t);
+    return epochs;
+}
+
+// Returns set as fp32, only copying it when it has
+// another dtype, so fp32 and mapped sets are trained
+// from in place.
+Set static set_f32(Set set) {
+    return set.dtype == MAT_F32 ? set : set_as(set, MAT_F32);
+}
+
+// Trains the network with the given set, a bf16 or
+// fp16 set being widened to fp32 once. Samples held
+// out with EVAL_SPLIT are evaluated every EVAL_EVERY
+// epochs, or every epoch when it's 0.
 // Returns the amount of epochs ran.
 size_t nn_fit(NN n, Set set) {
-    Mat x = set_to_mat(set_get_x(set, n.xs));
-    Mat y = set_to_mat(set_get_y(set, n.xs));
-    x = mat_t(x);
-    y = mat_t(y);
+    Set copy = set_f32(set);
+    size_t *rows = malloc(sizeof(size_t) * (copy.n > 0 ? copy.n : 1));
+    assert(rows != NULL);
+    for (size_t i = 0; i < copy.n; i++)
+        rows[i] = i;
 
-    size_t epochs = 0;
-    double c = MIN_ERROR;
-    NN g = new_nn_zero(n);
+    // The held out samples are picked at random once.
+    size_t held = EVAL_SPLIT > 0 ? (size_t) (copy.n * EVAL_SPLIT) : 0;
+    rows_shuffle(rows, copy.n, held);
+    SetRows train = { copy, rows + held, copy.n - held };
+    SetRows test = held > 0 ? (SetRows) { copy, rows, held } : train;
+    size_t every = held > 0 && EVAL_EVERY == 0 ? 1 : EVAL_EVERY;
+    size_t epochs = fit_sets(n, train, test, every);
+
+    free(rows);
+    if (copy.data != set.data) set_del(copy);
+    return epochs;
+}
+
+// Trains the network with set, evaluating it on the held
+// out samples of val every EVAL_EVERY epochs, or every
+// epoch when it's 0. EVAL_SPLIT doesn't apply.
+// Returns the amount of epochs ran.
+size_t nn_fit_val(NN n, Set set, Set val) {
+    Set train = set_f32(set);
+    Set test = set_f32(val);
+    size_t epochs = fit_sets(n, (SetRows) { train, NULL, train.n },
+                             (SetRows) { test, NULL, test.n },
+                             EVAL_EVERY > 0 ? EVAL_EVERY : 1);
+
+    if (train.data != set.data) set_del(train);
+    if (test.data != val.data) set_del(test);
+    return epochs;
+}
 
-    Set copy;
-    SET_ON_STACK(copy, set.n, set.m);
-    SET_STACK_COPY(copy, set);
+// Trains the network with the chunks of s, so the dataset
+// never has to fit in memory. Evaluations run over the
+// first EVAL_SAMPLES samples of the file (0 all of them),
+// EVAL_SPLIT doesn't apply to streams.
+// Returns the amount of epochs ran.
+size_t nn_fit_stream(NN n, SetStream *s) {
+    size_t epochs = 0;
+    double c, eval = INFINITY;
+    bool stop = false;
+    Trainer t = trainer_new(n);
+    Checkpoint best = checkpoint_new(n);
+    Profile prof = prof_begin(n);
 
     do {
-        Set shuffled = set_shuffle(copy);
-        for (size_t i = 0; i < shuffled.n; i += BATCH_SIZE) {
-            Set batch = set_batch(shuffled, i, i+BATCH_SIZE);
-            Mat x_batch = mat_t(set_to_mat(set_get_x(batch, n.xs)));
-            Mat y_batch = mat_t(set_to_mat(set_get_y(batch, n.xs)));
-            backpropagation(n, g, x_batch, y_batch);
+        double sum = 0;
+        size_t len = 0;
+        double start = prof_now();
+        stream_rewind(s);
+        for (Set chunk = stream_next(s); chunk.n > 0; chunk = stream_next(s)) {
+            prof_add(PHASE_SHUFFLE, start);
+            batcher_set(t.batches, chunk, NULL, chunk.n);
+            sum += fit_pass(n, t, false);
+            len += chunk.n;
+            start = prof_now();
+        }
+        prof_add(PHASE_SHUFFLE, start);
+
+        c = len > 0 ? sum / len : 0;
+        printf("%li: cost = %lf", epochs, c);
+        bool evaluated = eval_epoch(EVAL_EVERY, epochs);
+        if (evaluated) {
+            sum = 0;
+            len = 0;
+            stream_rewind(s);
+            for (Set chunk = stream_next(s); chunk.n > 0; chunk = stream_next(s)) {
+                size_t rows = chunk.n;
+                if (EVAL_SAMPLES > 0 && len + rows > EVAL_SAMPLES)
+                    rows = EVAL_SAMPLES - len;
+                batcher_set(t.evals, chunk, NULL, rows);
+                sum += eval_pass(n, t, rows, false);
+                len += rows;
+                if (len == EVAL_SAMPLES) break;
+            }
+
+            eval = len > 0 ? sum / len : 0;
+            stop = checkpoint_update(&best, n, epochs, eval);
+            printf(", eval = %lf", eval);
         }
 
-        printf("%li: cost = %lf\n", epochs, c);
-    } while ((c = mse(n, x, y)) > MIN_ERROR && ++epochs < MAX_EPOCHS);
+        puts("");
+        prof_epoch(&prof, epochs, c, evaluated ? eval : NAN);
+    } while ((EVAL_EVERY > 0 ? eval : c) > MIN_ERROR && !stop && ++epochs < MAX_EPOCHS);
 
-    nn_del(g);
+    prof_end(prof);
+    checkpoint_restore(best, n);
+    trainer_del(t);
     return epochs;
 }
 
@@ -205,6 +1069,7 @@ void nn_results(NN n, Set set) {
         return;
     
     nn_print(n);
+    set = set_as(set, MAT_F32);
     Mat x = set_to_mat(set_get_x(set, n.xs));
     Mat y = set_to_mat(set_get_y(set, n.xs));
     x = mat_t(x);
@@ -222,41 +1087,267 @@ void nn_results(NN n, Set set) {
         mat_print_no_nl(pred, "y':");
         puts("");
     }
+
+    set_del(set);
+}
+
+// Widens [lo,hi] to hold the entries of m.
+void static mat_range(Mat m, float *lo, float *hi) {
+    for (size_t i = 0; i < m.n; i++) {
+        for (size_t j = 0; j < m.m; j++) {
+            float v = mat_get(m, i, j);
+            *lo = v < *lo ? v : *lo;
+            *hi = v > *hi ? v : *hi;
+        }
+    }
+}
+
+// Returns an int8 copy of n. The range of the inputs of
+// every layer is calibrated forwarding the samples of
+// calib, which should look like the ones to be predicted.
+// The returned QNN needs to be free'd using qnn_del().
+QNN nn_quantize(NN n, Set calib) {
+    float *lo = malloc(sizeof(float) * n.len);
+    float *hi = malloc(sizeof(float) * n.len);
+    assert(lo != NULL && hi != NULL);
+    for (size_t i = 0; i < n.len; i++)
+        lo[i] = hi[i] = 0;
+
+    nn_reserve(n, EVAL_BATCH);
+    Mat x = mat_t(set_to_mat(set_get_x(calib, n.xs)));
+    for (size_t from = 0; from < x.m; from += EVAL_BATCH) {
+        size_t to = from + EVAL_BATCH < x.m ? from + EVAL_BATCH : x.m;
+        forward(n, mat_cols(x, from, to));
+        mat_range(mat_cols(x, from, to), &lo[0], &hi[0]);
+        for (size_t i = 1; i < n.len; i++)
+            mat_range(mat_cols(n.l[i-1].a, 0, to - from), &lo[i], &hi[i]);
+    }
+
+    QNN q = qnn_new(n.xs, n.l, n.len, lo, hi);
+    free(lo);
+    free(hi);
+    return q;
 }
 
-// Saves the nn to a file.
+// Differences between the outputs of a network and the
+// ones of its int8 copy over a set, and the mean loss of
+// both against the targets of the set.
+typedef struct QuantError {
+    double max_diff, mse_diff;
+    double loss, qloss;
+} QuantError;
+
+// Measures how far the outputs of q are from
+// the ones of n over the samples of set.
+QuantError nn_quant_error(NN n, QNN q, Set set) {
+    QuantError e = {0};
+    nn_reserve(n, EVAL_BATCH);
+    for (size_t from = 0; from < set.n; from += EVAL_BATCH) {
+        Set batch = set_batch(set, from, from + EVAL_BATCH);
+        Mat y = mat_t(set_to_mat(set_get_y(batch, n.xs)));
+        Mat pred = forward(n, mat_t(set_to_mat(set_get_x(batch, n.xs))));
+        Mat qpred = qnn_forward(q, set_get_x(batch, n.xs));
+
+        for (size_t i = 0; i < pred.n; i++) {
+            for (size_t j = 0; j < pred.m; j++) {
+                double p = mat_get(pred, i, j), qp = mat_get(qpred, i, j);
+                double t = i < y.n ? mat_get(y, i, j) : 0;
+                e.max_diff = fabs(p - qp) > e.max_diff ? fabs(p - qp) : e.max_diff;
+                e.mse_diff += (p - qp) * (p - qp);
+                e.loss += (p - t) * (p - t);
+                e.qloss += (qp - t) * (qp - t);
+            }
+        }
+    }
+
+    size_t len = set.n > 0 ? set.n : 1;
+    e.mse_diff /= len;
+    e.loss /= len;
+    e.qloss /= len;
+    return e;
+}
+
+// Prints how far the outputs of q are from the ones of n
+// over the samples of set and the size of both models.
+void nn_quant_report(NN n, QNN q, Set set) {
+    QuantError e = nn_quant_error(n, q, set);
+    size_t size = n.params->len * sizeof(MAT_TYPE);
+    printf("int8 (%s): %zu bytes, fp: %zu bytes\n", qnn_kernel_name(), qnn_size(q), size);
+    printf("max diff = %lf, mse diff = %lf\n", e.max_diff, e.mse_diff);
+    printf("loss = %lf, int8 loss = %lf\n", e.loss, e.qloss);
+}
+
+// Rounds offset up to NN_ALIGN.
+size_t static nn_align(size_t offset) {
+    return (offset + NN_ALIGN - 1) / NN_ALIGN * NN_ALIGN;
+}
+
+// Writes len bytes of data at offset, padding
+// the file with zeros up to it.
+bool static write_at(FILE *f, size_t offset, const void *data, size_t len) {
+    static const char zeros[NN_ALIGN];
+    long pos = ftell(f);
+    if (pos < 0 || (size_t) pos > offset) return false;
+    if (fwrite(zeros, 1, offset - pos, f) != offset - pos) return false;
+    return len == 0 || fwrite(data, 1, len, f) == len;
+}
+
+// Saves the nn to a file using the v2 format.
 void nn_save(NN n, const char *path) {
     FILE *f = fopen(path, "wb");
     assert(f != NULL);
 
-    size_t written = 0;
-    written += fwrite(&n.xs, sizeof(n.xs), 1, f);
-    written += fwrite(&n.len, sizeof(n.len), 1, f);
-    if (written != 2) {
-        fprintf(stderr, "Error saving nn");
-        fclose(f);
-        return;
+    NNHeader h = {
+        .magic = NN_MAGIC,
+        .version = NN_VERSION,
+        .endian = NN_ENDIAN,
+        .xs = n.xs,
+        .len = n.len,
+        .table = sizeof(NNHeader),
+    };
+
+    NNLayerEntry *table = calloc(n.len, sizeof(NNLayerEntry));
+    assert(table != NULL);
+    size_t offset = nn_align(h.table + n.len * sizeof(NNLayerEntry));
+    for (size_t i = 0; i < n.len; i++) {
+        Layer l = n.l[i];
+        table[i] = (NNLayerEntry) {
+            .act = l.act_func,
+            .dtype = l.w.dtype,
+            .n = l.w.n,
+            .m = l.w.m,
+            .w = offset,
+            .b = nn_align(offset + l.w.n * l.w.m * dtype_size(l.w.dtype)),
+        };
+        offset = nn_align(table[i].b + l.b.n * sizeof(MAT_TYPE));
     }
+    h.size = offset;
 
-    for (size_t i = 0; i < n.len; i++)
-        lay_save(n.l[i], f);
+    bool ok = write_at(f, 0, &h, sizeof(h))
+        && write_at(f, h.table, table, n.len * sizeof(NNLayerEntry));
+
+    // The arena is laid out like the data region of the
+    // file, so usually all the parameters go in one write.
+    size_t start = nn_align(h.table + n.len * sizeof(NNLayerEntry));
+    bool packed = n.params->len * sizeof(MAT_TYPE) == h.size - start;
+    for (size_t i = 0; i < n.len && packed; i++)
+        packed = (char *) n.l[i].w.data - (char *) n.params->data == table[i].w - start
+              && (char *) n.l[i].b.data - (char *) n.params->data == table[i].b - start;
+
+    if (packed)
+        ok = ok && write_at(f, start, n.params->data, h.size - start);
+
+    for (size_t i = 0; i < n.len && ok && !packed; i++) {
+        Layer l = n.l[i];
+        size_t row = l.w.m * dtype_size(l.w.dtype);
+        for (size_t r = 0; r < l.w.n && ok; r++)
+            ok = write_at(f, table[i].w + r * row, mat_ptr(l.w, r, 0), row);
+        for (size_t r = 0; r < l.b.n && ok; r++)
+            ok = write_at(f, table[i].b + r * sizeof(MAT_TYPE),
+                          &MAT_AT(l.b, r, 0), sizeof(MAT_TYPE));
+    }
+    ok = ok && write_at(f, h.size, NULL, 0);
+
+    free(table);
     fclose(f);
+    if (!ok) {
+        fprintf(stderr, "Error saving nn to %s\n", path);
+        exit(1);
+    }
 }
 
-// Returns an empty nn with the given amount of layers.
-NN static new_nn_with(size_t xs, size_t len) {
-    NN n = (NN) {
-        .xs = xs,
-        .len = len,
-        .l = malloc(sizeof(Layer) * len),
-    };
+// Checks the header and layer table of a v2 file
+// of len bytes. Returns the table or NULL.
+const NNLayerEntry static *nn_v2_table(const void *map, size_t len) {
+    const NNHeader *h = map;
+    if (len < sizeof(*h) || memcmp(h->magic, NN_MAGIC, sizeof(h->magic)) != 0)
+        return NULL;
+    if (h->endian != NN_ENDIAN) {
+        fprintf(stderr, "nn file has a different endianness\n");
+        return NULL;
+    }
+    if (h->version != NN_VERSION || h->size > len || h->table % NN_ALIGN != 0
+        || h->table + h->len * sizeof(NNLayerEntry) > len)
+        return NULL;
 
-    assert(n.l != NULL);
+    const NNLayerEntry *table = (const void *) ((const char *) map + h->table);
+    size_t inputs = h->xs;
+    for (size_t i = 0; i < h->len; i++) {
+        const NNLayerEntry *e = &table[i];
+        if (e->act > SOFTMAX || e->dtype > MAT_F16 || e->m != inputs
+            || e->w % NN_ALIGN != 0 || e->b % NN_ALIGN != 0
+            || e->w + e->n * e->m * dtype_size(e->dtype) > len
+            || e->b + e->n * sizeof(MAT_TYPE) > len)
+            return NULL;
+        inputs = e->n;
+    }
+
+    return table;
+}
+
+// Builds a nn from a mapped v2 file. The weights are
+// copied unless in_place is set, then they point
+// straight into the mapping.
+NN static nn_from_v2(void *map, size_t len, bool in_place) {
+    const NNHeader *h = map;
+    const NNLayerEntry *table = nn_v2_table(map, len);
+    if (!table) {
+        fprintf(stderr, "Error reading nn, invalid v2 file\n");
+        exit(1);
+    }
+
+    NN n = new_nn_with(h->xs, h->len);
+    size_t start = nn_align(h->table + h->len * sizeof(NNLayerEntry));
+    if (in_place) {
+        *n.params = arena_view((MAT_TYPE *) ((char *) map + start),
+                               (len - start) / sizeof(MAT_TYPE));
+    } else {
+        size_t size = 0;
+        for (size_t i = 0; i < n.len; i++)
+            size += arena_size_as(table[i].n, table[i].m, table[i].dtype)
+                  + arena_size(table[i].n, 1);
+        *n.params = arena_new(size);
+    }
+
+    for (size_t i = 0; i < n.len; i++) {
+        const NNLayerEntry *e = &table[i];
+        const char *w = (const char *) map + e->w;
+        const char *b = (const char *) map + e->b;
+        n.l[i] = lay_new_in_as(n.params, e->n, e->m, e->act, e->dtype);
+
+        if (!in_place) {
+            memcpy(n.l[i].w.data, w, e->n * e->m * dtype_size(e->dtype));
+            memcpy(n.l[i].b.data, b, e->n * sizeof(MAT_TYPE));
+        } else if ((char *) n.l[i].w.data != w || (char *) n.l[i].b.data != b) {
+            fprintf(stderr, "Error mapping nn, its data isn't packed\n");
+            exit(1);
+        }
+    }
+
+    nn_reserve(n, 1);
     return n;
 }
 
-// Loads a nn from a file.
-NN nn_from(const char *path) {
+// Maps the file at path. Returns NULL if it's not a file.
+void static *nn_map_file(const char *path, size_t *len) {
+    int fd = open(path, O_RDONLY);
+    assert(fd != -1);
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    *len = st.st_size;
+    return map == MAP_FAILED ? NULL : map;
+}
+
+// Loads a nn from a v1 file, made of raw dimensions,
+// activation enums and matrices.
+NN static nn_from_v1(const char *path) {
     FILE *f = fopen(path, "rb");
     assert(f != NULL);
 
@@ -269,11 +1360,62 @@ NN nn_from(const char *path) {
         exit(1);
     }
 
-    NN n = new_nn_with(xs, len);
-    for (size_t i = 0; i < n.len; i++)
-        n.l[i] = lay_from(f);
-    
+    Layer *l = malloc(sizeof(Layer) * len);
+    assert(l != NULL);
+
+    size_t size = 0;
+    for (size_t i = 0; i < len; i++) {
+        l[i] = lay_from(f);
+        size += arena_size(l[i].w.n, l[i].w.m) + arena_size(l[i].b.n, 1);
+    }
     fclose(f);
+
+    NN n = new_nn_with(xs, len);
+    *n.params = arena_new(size);
+    for (size_t i = 0; i < n.len; i++) {
+        n.l[i] = lay_new_in(n.params, l[i].w.n, l[i].w.m, l[i].act_func);
+        mat_copy(n.l[i].w, l[i].w);
+        mat_copy(n.l[i].b, l[i].b);
+        lay_del(l[i]);
+    }
+
+    free(l);
+    nn_reserve(n, 1);
+    return n;
+}
+
+// Loads a nn from a file, either v2 or the
+// older headerless format.
+NN nn_from(const char *path) {
+    size_t len;
+    void *map = nn_map_file(path, &len);
+    if (!map || len < sizeof(NNHeader) || memcmp(map, NN_MAGIC, 8) != 0) {
+        if (map) munmap(map, len);
+        return nn_from_v1(path);
+    }
+
+    NN n = nn_from_v2(map, len, false);
+    munmap(map, len);
+    return n;
+}
+
+// Maps a v2 file read-only and returns a nn whose weights
+// and biases point straight into the mapping, so loading
+// doesn't depend on the size of the model and processes
+// mapping the same file share its pages. The weights
+// can't be modified, the nn is meant for inference and
+// can't be trained.
+NN nn_map(const char *path) {
+    size_t len;
+    void *map = nn_map_file(path, &len);
+    if (!map) {
+        fprintf(stderr, "Error mapping nn %s\n", path);
+        exit(1);
+    }
+
+    NN n = nn_from_v2(map, len, true);
+    n.map = map;
+    n.map_len = len;
     return n;
 }
 
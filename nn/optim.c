@@ -0,0 +1,114 @@
+#include "optim.h"
+
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+// Every kernel is built for AVX-512, AVX2 and the
+// baseline ISA, the best one is picked at load time.
+#if defined(__x86_64__) && defined(__GNUC__)
+#define OPTIM_CLONES __attribute__((target_clones("avx512f", "avx2,fma", "default")))
+#else
+#define OPTIM_CLONES
+#endif
+
+// Returns a zeroed state buffer of len floats.
+static float *optim_buffer(size_t len) {
+    float *b = calloc(len > 0 ? len : 1, sizeof(float));
+    assert(b != NULL);
+    return b;
+}
+
+// Returns an optimizer for len parameters. lr is the
+// learning rate, beta1 the momentum of the gradients,
+// beta2 the decay of the average of their squares and
+// eps keeps the adaptive steps away from a division by 0.
+// The returned Optim needs to be free'd using optim_del().
+Optim optim_new(enum OPTIMIZER kind, size_t len, float lr, float beta1, float beta2, float eps) {
+    assert(kind <= ADAM);
+    Optim o = {
+        .kind = kind,
+        .len = len,
+        .lr = lr,
+        .beta1 = beta1,
+        .beta2 = beta2,
+        .eps = eps,
+    };
+
+    if (kind == MOMENTUM || kind == ADAM) o.m = optim_buffer(len);
+    if (kind == RMSPROP || kind == ADAM) o.v = optim_buffer(len);
+    return o;
+}
+
+// Every update reads the gradient, its state and the
+// parameter once and writes them once, in one loop.
+
+OPTIM_CLONES
+static void step_sgd(float *restrict p, const float *restrict g, size_t len, float lr) {
+    for (size_t i = 0; i < len; i++)
+        p[i] -= lr * g[i];
+}
+
+OPTIM_CLONES
+static void step_momentum(float *restrict p, const float *restrict g, float *restrict m,
+                          size_t len, float scale, float lr, float beta1) {
+    for (size_t i = 0; i < len; i++) {
+        m[i] = beta1 * m[i] + scale * g[i];
+        p[i] -= lr * m[i];
+    }
+}
+
+OPTIM_CLONES
+static void step_rmsprop(float *restrict p, const float *restrict g, float *restrict v,
+                         size_t len, float scale, float lr, float beta2, float eps) {
+    for (size_t i = 0; i < len; i++) {
+        float gi = scale * g[i];
+        v[i] = beta2 * v[i] + (1 - beta2) * gi * gi;
+        p[i] -= lr * gi / (sqrtf(v[i]) + eps);
+    }
+}
+
+OPTIM_CLONES
+static void step_adam(float *restrict p, const float *restrict g, float *restrict m,
+                      float *restrict v, size_t len, float scale, float lr,
+                      float beta1, float beta2, float eps) {
+    for (size_t i = 0; i < len; i++) {
+        float gi = scale * g[i];
+        m[i] = beta1 * m[i] + (1 - beta1) * gi;
+        v[i] = beta2 * v[i] + (1 - beta2) * gi * gi;
+        p[i] -= lr * m[i] / (sqrtf(v[i]) + eps);
+    }
+}
+
+// Updates the parameters with grad times scale, the
+// gradient being summed over the samples of a batch
+// and scale usually one over their amount.
+void optim_step(Optim *o, float *params, const float *grad, float scale) {
+    o->t++;
+    switch (o->kind) {
+    case MOMENTUM:
+        step_momentum(params, grad, o->m, o->len, scale, o->lr, o->beta1);
+        break;
+    case RMSPROP:
+        step_rmsprop(params, grad, o->v, o->len, scale, o->lr, o->beta2, o->eps);
+        break;
+    case ADAM: {
+        // The bias correction of both averages is folded
+        // into the learning rate of the step.
+        float c1 = 1 - powf(o->beta1, o->t);
+        float c2 = 1 - powf(o->beta2, o->t);
+        step_adam(params, grad, o->m, o->v, o->len, scale,
+                  o->lr * sqrtf(c2) / c1, o->beta1, o->beta2, o->eps);
+        break;
+    }
+    default:
+        step_sgd(params, grad, o->len, o->lr * scale);
+        break;
+    }
+}
+
+// Frees the state of o.
+void optim_del(Optim o) {
+    free(o.m);
+    free(o.v);
+}
@@ -0,0 +1,23 @@
+#ifndef __OPTIM_H__
+#define __OPTIM_H__
+
+#include <stdlib.h>
+
+enum OPTIMIZER { SGD, MOMENTUM, RMSPROP, ADAM };
+
+// Update rule of a flat vector of parameters. m and v hold
+// one entry per parameter, the running average of the
+// gradients and of their squares, and are only allocated
+// by the optimizers that use them. t counts the steps.
+typedef struct Optim {
+    enum OPTIMIZER kind;
+    float *m, *v;
+    size_t len, t;
+    float lr, beta1, beta2, eps;
+} Optim;
+
+Optim optim_new(enum OPTIMIZER kind, size_t len, float lr, float beta1, float beta2, float eps);
+void optim_step(Optim *o, float *params, const float *grad, float scale);
+void optim_del(Optim o);
+
+#endif // __OPTIM_H__
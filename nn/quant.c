@@ -0,0 +1,623 @@
+#include "quant.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define QNN_X86
+#endif
+
+_Static_assert(sizeof(QNNHeader) == QNN_ALIGN, "QNNHeader must be 64 bytes");
+_Static_assert(sizeof(QNNLayerEntry) == QNN_ALIGN, "QNNLayerEntry must be 64 bytes");
+
+// Rows of weights every task of a parallel forward
+// takes at least, in bytes.
+#define QNN_PAR_BYTES (1 << 16)
+
+// Rounds len up to QNN_ALIGN.
+static size_t qnn_align(size_t len) {
+    return (len + QNN_ALIGN - 1) / QNN_ALIGN * QNN_ALIGN;
+}
+
+// Rows of weights and samples every tile takes.
+#define QNN_TILE 4
+
+// Returns the dot product of the len entries of x and w,
+// len being a multiple of QNN_ALIGN.
+typedef int32_t (*qdot_t)(const uint8_t *x, const int8_t *w, size_t len);
+
+// Computes the dot products of QNN_TILE rows of w, every ldw
+// entries, with QNN_TILE samples of x, every ldx entries, so
+// every load is used by several products.
+typedef void (*qtile_t)(const uint8_t *x, size_t ldx, const int8_t *w, size_t ldw,
+                        size_t len, int32_t out[QNN_TILE][QNN_TILE]);
+
+typedef struct QKernel {
+    const char *name;
+    qdot_t dot;
+    qtile_t tile;
+} QKernel;
+
+static int32_t qdot_scalar(const uint8_t *x, const int8_t *w, size_t len) {
+    int32_t sum = 0;
+    for (size_t p = 0; p < len; p++)
+        sum += (int32_t) x[p] * w[p];
+    return sum;
+}
+
+static void qtile_scalar(const uint8_t *x, size_t ldx, const int8_t *w, size_t ldw,
+                         size_t len, int32_t out[QNN_TILE][QNN_TILE]) {
+    for (size_t r = 0; r < QNN_TILE; r++)
+        for (size_t c = 0; c < QNN_TILE; c++)
+            out[r][c] = qdot_scalar(x + c*ldx, w + r*ldw, len);
+}
+
+#ifdef QNN_X86
+__attribute__((target("avx2")))
+static int32_t hsum_avx2(__m256i v) {
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(s);
+}
+
+// Both operands are widened to 16 bits, so madd can't
+// saturate like maddubs does with u8*s8 pairs.
+__attribute__((target("avx2")))
+static int32_t qdot_avx2(const uint8_t *x, const int8_t *w, size_t len) {
+    __m256i acc0 = _mm256_setzero_si256();
+    __m256i acc1 = _mm256_setzero_si256();
+    for (size_t p = 0; p < len; p += 32) {
+        __m256i x0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (x + p)));
+        __m256i x1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (x + p + 16)));
+        __m256i w0 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) (w + p)));
+        __m256i w1 = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) (w + p + 16)));
+        acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(x0, w0));
+        acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(x1, w1));
+    }
+
+    return hsum_avx2(_mm256_add_epi32(acc0, acc1));
+}
+
+// Two rows at a time, so the accumulators and the
+// widened samples fit in the 16 ymm registers.
+__attribute__((target("avx2")))
+static void qtile_avx2(const uint8_t *x, size_t ldx, const int8_t *w, size_t ldw,
+                       size_t len, int32_t out[QNN_TILE][QNN_TILE]) {
+    for (size_t r = 0; r < QNN_TILE; r += 2) {
+        __m256i acc[2][QNN_TILE];
+        for (size_t i = 0; i < 2; i++)
+            for (size_t c = 0; c < QNN_TILE; c++)
+                acc[i][c] = _mm256_setzero_si256();
+
+        for (size_t p = 0; p < len; p += 16) {
+            __m256i xv[QNN_TILE];
+            for (size_t c = 0; c < QNN_TILE; c++)
+                xv[c] = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (x + c*ldx + p)));
+            for (size_t i = 0; i < 2; i++) {
+                const int8_t *wi = w + (r + i)*ldw + p;
+                __m256i wv = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *) wi));
+                for (size_t c = 0; c < QNN_TILE; c++)
+                    acc[i][c] = _mm256_add_epi32(acc[i][c], _mm256_madd_epi16(xv[c], wv));
+            }
+        }
+
+        for (size_t i = 0; i < 2; i++)
+            for (size_t c = 0; c < QNN_TILE; c++)
+                out[r + i][c] = hsum_avx2(acc[i][c]);
+    }
+}
+
+// u8*s8 products summed in groups of 4 straight into int32.
+__attribute__((target("avx2,avxvnni")))
+static int32_t qdot_avxvnni(const uint8_t *x, const int8_t *w, size_t len) {
+    __m256i acc0 = _mm256_setzero_si256();
+    __m256i acc1 = _mm256_setzero_si256();
+    for (size_t p = 0; p < len; p += 64) {
+        acc0 = _mm256_dpbusd_avx_epi32(acc0, _mm256_loadu_si256((const __m256i *) (x + p)),
+                                       _mm256_loadu_si256((const __m256i *) (w + p)));
+        acc1 = _mm256_dpbusd_avx_epi32(acc1, _mm256_loadu_si256((const __m256i *) (x + p + 32)),
+                                       _mm256_loadu_si256((const __m256i *) (w + p + 32)));
+    }
+
+    return hsum_avx2(_mm256_add_epi32(acc0, acc1));
+}
+
+__attribute__((target("avx2,avxvnni")))
+static void qtile_avxvnni(const uint8_t *x, size_t ldx, const int8_t *w, size_t ldw,
+                          size_t len, int32_t out[QNN_TILE][QNN_TILE]) {
+    for (size_t r = 0; r < QNN_TILE; r += 2) {
+        __m256i acc[2][QNN_TILE];
+        for (size_t i = 0; i < 2; i++)
+            for (size_t c = 0; c < QNN_TILE; c++)
+                acc[i][c] = _mm256_setzero_si256();
+
+        for (size_t p = 0; p < len; p += 32) {
+            __m256i xv[QNN_TILE];
+            for (size_t c = 0; c < QNN_TILE; c++)
+                xv[c] = _mm256_loadu_si256((const __m256i *) (x + c*ldx + p));
+            for (size_t i = 0; i < 2; i++) {
+                __m256i wv = _mm256_loadu_si256((const __m256i *) (w + (r + i)*ldw + p));
+                for (size_t c = 0; c < QNN_TILE; c++)
+                    acc[i][c] = _mm256_dpbusd_avx_epi32(acc[i][c], xv[c], wv);
+            }
+        }
+
+        for (size_t i = 0; i < 2; i++)
+            for (size_t c = 0; c < QNN_TILE; c++)
+                out[r + i][c] = hsum_avx2(acc[i][c]);
+    }
+}
+
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static int32_t qdot_avx512vnni(const uint8_t *x, const int8_t *w, size_t len) {
+    __m512i acc = _mm512_setzero_si512();
+    for (size_t p = 0; p < len; p += 64)
+        acc = _mm512_dpbusd_epi32(acc, _mm512_loadu_si512(x + p), _mm512_loadu_si512(w + p));
+    return _mm512_reduce_add_epi32(acc);
+}
+
+// 16 zmm accumulators, the whole tile at once.
+__attribute__((target("avx512f,avx512bw,avx512vnni")))
+static void qtile_avx512vnni(const uint8_t *x, size_t ldx, const int8_t *w, size_t ldw,
+                             size_t len, int32_t out[QNN_TILE][QNN_TILE]) {
+    __m512i acc[QNN_TILE][QNN_TILE];
+    for (size_t r = 0; r < QNN_TILE; r++)
+        for (size_t c = 0; c < QNN_TILE; c++)
+            acc[r][c] = _mm512_setzero_si512();
+
+    for (size_t p = 0; p < len; p += 64) {
+        __m512i xv[QNN_TILE];
+        for (size_t c = 0; c < QNN_TILE; c++)
+            xv[c] = _mm512_loadu_si512(x + c*ldx + p);
+        for (size_t r = 0; r < QNN_TILE; r++) {
+            __m512i wv = _mm512_loadu_si512(w + r*ldw + p);
+            for (size_t c = 0; c < QNN_TILE; c++)
+                acc[r][c] = _mm512_dpbusd_epi32(acc[r][c], xv[c], wv);
+        }
+    }
+
+    for (size_t r = 0; r < QNN_TILE; r++)
+        for (size_t c = 0; c < QNN_TILE; c++)
+            out[r][c] = _mm512_reduce_add_epi32(acc[r][c]);
+}
+#endif
+
+static const QKernel qkernels[] = {
+    { "scalar",     qdot_scalar,     qtile_scalar },
+#ifdef QNN_X86
+    { "avx2",       qdot_avx2,       qtile_avx2 },
+    { "avxvnni",    qdot_avxvnni,    qtile_avxvnni },
+    { "avx512vnni", qdot_avx512vnni, qtile_avx512vnni },
+#endif
+};
+
+// Picks the widest kernel the CPU supports. Every kernel
+// sums exactly, so all of them give the same results.
+static const QKernel *qnn_kernel(void) {
+#ifdef QNN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512bw"))
+        return &qkernels[3];
+    if (__builtin_cpu_supports("avxvnni"))
+        return &qkernels[2];
+    if (__builtin_cpu_supports("avx2"))
+        return &qkernels[1];
+#endif
+    return &qkernels[0];
+}
+
+const char *qnn_kernel_name(void) {
+    return qnn_kernel()->name;
+}
+
+// Returns the bytes the params of l take.
+static size_t qlay_size(QLayer l) {
+    return qnn_align(l.n * l.kp) + 3 * qnn_align(l.n * sizeof(float));
+}
+
+// Returns a nn of len layers whose shapes are
+// already set, carving every layer from params.
+static QNN qnn_carve(QNN q) {
+    size_t size = 0;
+    for (size_t i = 0; i < q.len; i++)
+        size += qlay_size(q.l[i]);
+
+    q.params = aligned_alloc(QNN_ALIGN, size > 0 ? size : QNN_ALIGN);
+    assert(q.params != NULL);
+    memset(q.params, 0, size);
+
+    char *p = q.params;
+    for (size_t i = 0; i < q.len; i++) {
+        QLayer *l = &q.l[i];
+        l->w = (int8_t *) p;
+        p += qnn_align(l->n * l->kp);
+        l->scale = (float *) p;
+        p += qnn_align(l->n * sizeof(float));
+        l->b = (float *) p;
+        p += qnn_align(l->n * sizeof(float));
+        l->wsum = (int32_t *) p;
+        p += qnn_align(l->n * sizeof(int32_t));
+    }
+
+    q.buf = calloc(1, sizeof(QBuf));
+    assert(q.buf != NULL);
+    return q;
+}
+
+// Returns an empty nn with the given amount of layers.
+static QNN qnn_with(size_t xs, size_t len) {
+    QNN q = {
+        .xs = xs,
+        .len = len,
+        .l = calloc(len, sizeof(QLayer)),
+    };
+
+    assert(q.l != NULL);
+    return q;
+}
+
+// Sums the rows of the weights of l.
+static void qlay_wsum(QLayer l) {
+    for (size_t i = 0; i < l.n; i++) {
+        int32_t sum = 0;
+        for (size_t p = 0; p < l.m; p++)
+            sum += l.w[i*l.kp + p];
+        l.wsum[i] = sum;
+    }
+}
+
+// Quantizes the layers l of a network with xs inputs. The
+// inputs of the i'th layer are expected in [lo[i],hi[i]],
+// values out of it are clamped.
+// The returned QNN needs to be free'd using qnn_del().
+QNN qnn_new(size_t xs, const Layer *l, size_t len, const float *lo, const float *hi) {
+    assert(len > 0);
+    QNN q = qnn_with(xs, len);
+    for (size_t i = 0; i < len; i++) {
+        assert(l[i].w.m == (i > 0 ? l[i-1].w.n : xs));
+        q.l[i] = (QLayer) {
+            .n = l[i].w.n,
+            .m = l[i].w.m,
+            .kp = qnn_align(l[i].w.m),
+            .act = l[i].act_func,
+        };
+    }
+    q = qnn_carve(q);
+
+    for (size_t i = 0; i < len; i++) {
+        QLayer *ql = &q.l[i];
+        for (size_t r = 0; r < ql->n; r++) {
+            float max = 0;
+            for (size_t p = 0; p < ql->m; p++)
+                max = fmaxf(max, fabsf(mat_get(l[i].w, r, p)));
+
+            float scale = max > 0 ? max / 127 : 1;
+            for (size_t p = 0; p < ql->m; p++)
+                ql->w[r*ql->kp + p] = (int8_t) lrintf(mat_get(l[i].w, r, p) / scale);
+            ql->scale[r] = scale;
+            ql->b[r] = mat_get(l[i].b, r, 0);
+        }
+        qlay_wsum(*ql);
+
+        // The range always holds 0, so it's stored exactly.
+        float min = fminf(lo[i], 0), max = fmaxf(hi[i], 0);
+        ql->in_scale = max > min ? (max - min) / 255 : 1;
+        long zero = lrintf(-min / ql->in_scale);
+        ql->in_zero = zero < 0 ? 0 : zero > 255 ? 255 : zero;
+    }
+
+    return q;
+}
+
+// Grows the scratch space of q so a batch
+// of `cols` samples can be forwarded.
+void qnn_reserve(QNN q, size_t cols) {
+    QBuf *buf = q.buf;
+    if (buf->xq && buf->cap >= cols) return;
+
+    size_t kp = 0, len = q.xs;
+    for (size_t i = 0; i < q.len; i++) {
+        kp = q.l[i].kp > kp ? q.l[i].kp : kp;
+        len = q.l[i].n > len ? q.l[i].n : len;
+    }
+
+    free(buf->xq);
+    free(buf->a[0]);
+    free(buf->a[1]);
+    buf->xq = aligned_alloc(QNN_ALIGN, qnn_align(cols * kp));
+    buf->a[0] = aligned_alloc(QNN_ALIGN, qnn_align(cols * len * sizeof(float)));
+    buf->a[1] = aligned_alloc(QNN_ALIGN, qnn_align(cols * len * sizeof(float)));
+    assert(buf->xq && buf->a[0] && buf->a[1]);
+    buf->cap = cols;
+}
+
+// Quantizes the m entries of x into the kp entries of q,
+// padding them with zeros. Values are rounded to nearest.
+static void quantize_row(const float *x, size_t m, size_t kp,
+                         float scale, int32_t zero, uint8_t *q) {
+    float inv = 1 / scale;
+    for (size_t p = 0; p < m; p++) {
+        float v = x[p] * inv + zero + 0.5f;
+        v = v < 0 ? 0 : v;
+        v = v > 255 ? 255 : v;
+        q[p] = (uint8_t) v;
+    }
+
+    memset(q + m, 0, kp - m);
+}
+
+typedef struct QForward {
+    const QLayer *l;
+    const uint8_t *xq;
+    float *out;
+    size_t cols;
+    const QKernel *kern;
+} QForward;
+
+// Computes the outputs of rows [begin,end) of a layer for
+// every sample, QNN_TILE rows by QNN_TILE samples at once.
+static void qlay_rows(size_t begin, size_t end, void *ctx) {
+    const QForward *f = ctx;
+    const QLayer *l = f->l;
+    for (size_t i = begin; i < end; i += QNN_TILE) {
+        size_t rows = end - i < QNN_TILE ? end - i : QNN_TILE;
+        for (size_t c = 0; c < f->cols; c += QNN_TILE) {
+            size_t cols = f->cols - c < QNN_TILE ? f->cols - c : QNN_TILE;
+            const uint8_t *x = f->xq + c*l->kp;
+            const int8_t *w = l->w + i*l->kp;
+            int32_t acc[QNN_TILE][QNN_TILE];
+            if (rows == QNN_TILE && cols == QNN_TILE) {
+                f->kern->tile(x, l->kp, w, l->kp, l->kp, acc);
+            } else {
+                for (size_t r = 0; r < rows; r++)
+                    for (size_t s = 0; s < cols; s++)
+                        acc[r][s] = f->kern->dot(x + s*l->kp, w + r*l->kp, l->kp);
+            }
+
+            for (size_t r = 0; r < rows; r++) {
+                float scale = l->scale[i + r] * l->in_scale;
+                int64_t zero = (int64_t) l->in_zero * l->wsum[i + r];
+                for (size_t s = 0; s < cols; s++) {
+                    float v = scale * (float) (acc[r][s] - zero) + l->b[i + r];
+                    f->out[(c + s)*l->n + i + r] = act_apply(l->act, v);
+                }
+            }
+        }
+    }
+}
+
+// Returns the Matrix of predicted values given x, with one
+// row per output and one col per sample like nn_forward(),
+// splitting the rows of wide layers between the workers of
+// pool. The result is valid until the next forward.
+Mat qnn_forward_par(QNN q, ThreadPool *pool, Set x) {
+    assert(x.m == q.xs);
+    qnn_reserve(q, x.n);
+    QBuf *buf = q.buf;
+    const QKernel *kern = qnn_kernel();
+
+    // The first layer writes a[0], a[1] holds the inputs
+    // while they're converted to fp32.
+    const QLayer *l = &q.l[0];
+    for (size_t c = 0; c < x.n; c++) {
+        const float *row = buf->a[1];
+        Set r = set_row(x, c);
+        if (x.dtype == MAT_F32) row = r.data;
+        else dtype_to_f32(x.dtype, buf->a[1], r.data, x.m);
+        quantize_row(row, l->m, l->kp, l->in_scale, l->in_zero, buf->xq + c*l->kp);
+    }
+
+    float *out = NULL;
+    for (size_t i = 0; i < q.len; i++) {
+        l = &q.l[i];
+        if (i > 0) {
+            const QLayer *prev = &q.l[i-1];
+            for (size_t c = 0; c < x.n; c++)
+                quantize_row(out + c*prev->n, l->m, l->kp, l->in_scale, l->in_zero,
+                             buf->xq + c*l->kp);
+        }
+
+        out = buf->a[i % 2];
+        QForward f = { .l = l, .xq = buf->xq, .out = out, .cols = x.n, .kern = kern };
+        size_t grain = QNN_PAR_BYTES / (l->kp * (x.n > 0 ? x.n : 1));
+        grain = (grain + QNN_TILE - 1) / QNN_TILE * QNN_TILE;
+        thpool_parallel_for(pool, 0, l->n, grain > 0 ? grain : QNN_TILE, qlay_rows, &f);
+        if (l->act == SOFTMAX)
+            for (size_t c = 0; c < x.n; c++)
+                act_softmax(out + c*l->n, l->n);
+    }
+
+    // Outputs are stored one sample per row.
+    return (Mat) {
+        .data = out,
+        .free_ptr = NULL,
+        .n = l->n,
+        .m = x.n,
+        .step = l->n,
+        .stride = 1,
+        .dtype = MAT_F32,
+    };
+}
+
+// Returns the Matrix of predicted values given x.
+Mat qnn_forward(QNN q, Set x) {
+    return qnn_forward_par(q, NULL, x);
+}
+
+// Returns the bytes taken by the weights, scales
+// and biases of q.
+size_t qnn_size(QNN q) {
+    size_t size = 0;
+    for (size_t i = 0; i < q.len; i++)
+        size += q.l[i].n * q.l[i].kp + 2 * q.l[i].n * sizeof(float);
+    return size;
+}
+
+// Writes len bytes of data at offset, padding
+// the file with zeros up to it.
+static bool write_at(FILE *f, size_t offset, const void *data, size_t len) {
+    static const char zeros[QNN_ALIGN];
+    long pos = ftell(f);
+    if (pos < 0 || (size_t) pos > offset) return false;
+    if (fwrite(zeros, 1, offset - pos, f) != offset - pos) return false;
+    return len == 0 || fwrite(data, 1, len, f) == len;
+}
+
+// Saves q to a file using the quantized format.
+void qnn_save(QNN q, const char *path) {
+    FILE *f = fopen(path, "wb");
+    assert(f != NULL);
+
+    QNNHeader h = {
+        .magic = QNN_MAGIC,
+        .version = QNN_VERSION,
+        .endian = QNN_ENDIAN,
+        .xs = q.xs,
+        .len = q.len,
+        .table = sizeof(QNNHeader),
+    };
+
+    QNNLayerEntry *table = calloc(q.len, sizeof(QNNLayerEntry));
+    assert(table != NULL);
+    size_t offset = qnn_align(h.table + q.len * sizeof(QNNLayerEntry));
+    for (size_t i = 0; i < q.len; i++) {
+        QLayer l = q.l[i];
+        table[i] = (QNNLayerEntry) {
+            .act = l.act,
+            .in_zero = l.in_zero,
+            .in_scale = l.in_scale,
+            .n = l.n,
+            .m = l.m,
+            .w = offset,
+            .scale = qnn_align(offset + l.n * l.kp),
+        };
+        table[i].b = qnn_align(table[i].scale + l.n * sizeof(float));
+        offset = qnn_align(table[i].b + l.n * sizeof(float));
+    }
+    h.size = offset;
+
+    bool ok = write_at(f, 0, &h, sizeof(h))
+        && write_at(f, h.table, table, q.len * sizeof(QNNLayerEntry));
+    for (size_t i = 0; i < q.len && ok; i++) {
+        QLayer l = q.l[i];
+        ok = write_at(f, table[i].w, l.w, l.n * l.kp)
+            && write_at(f, table[i].scale, l.scale, l.n * sizeof(float))
+            && write_at(f, table[i].b, l.b, l.n * sizeof(float));
+    }
+    ok = ok && write_at(f, h.size, NULL, 0);
+
+    free(table);
+    fclose(f);
+    if (!ok) {
+        fprintf(stderr, "Error saving quantized nn to %s\n", path);
+        exit(1);
+    }
+}
+
+// Checks the header and layer table of a quantized
+// file of len bytes. Returns the table or NULL.
+static const QNNLayerEntry *qnn_table(const void *map, size_t len) {
+    const QNNHeader *h = map;
+    if (len < sizeof(*h) || memcmp(h->magic, QNN_MAGIC, sizeof(h->magic)) != 0)
+        return NULL;
+    if (h->endian != QNN_ENDIAN) {
+        fprintf(stderr, "quantized nn file has a different endianness\n");
+        return NULL;
+    }
+    if (h->version != QNN_VERSION || h->len == 0 || h->size > len
+        || h->table % QNN_ALIGN != 0
+        || h->table + h->len * sizeof(QNNLayerEntry) > len)
+        return NULL;
+
+    const QNNLayerEntry *table = (const void *) ((const char *) map + h->table);
+    size_t inputs = h->xs;
+    for (size_t i = 0; i < h->len; i++) {
+        const QNNLayerEntry *e = &table[i];
+        if (e->act > SOFTMAX || e->m != inputs || e->in_zero < 0 || e->in_zero > 255
+            || !(e->in_scale > 0)
+            || e->w % QNN_ALIGN != 0 || e->scale % QNN_ALIGN != 0 || e->b % QNN_ALIGN != 0
+            || e->w + e->n * qnn_align(e->m) > len
+            || e->scale + e->n * sizeof(float) > len
+            || e->b + e->n * sizeof(float) > len)
+            return NULL;
+        inputs = e->n;
+    }
+
+    return table;
+}
+
+// Loads a quantized nn saved with qnn_save().
+// The returned QNN needs to be free'd using qnn_del().
+QNN qnn_from(const char *path) {
+    int fd = open(path, O_RDONLY);
+    assert(fd != -1);
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        fprintf(stderr, "Error reading quantized nn %s\n", path);
+        close(fd);
+        exit(1);
+    }
+
+    size_t len = st.st_size;
+    void *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Error mapping quantized nn");
+        exit(1);
+    }
+
+    const QNNHeader *h = map;
+    const QNNLayerEntry *table = qnn_table(map, len);
+    if (!table) {
+        fprintf(stderr, "Error reading quantized nn, invalid file %s\n", path);
+        munmap(map, len);
+        exit(1);
+    }
+
+    QNN q = qnn_with(h->xs, h->len);
+    for (size_t i = 0; i < q.len; i++) {
+        const QNNLayerEntry *e = &table[i];
+        q.l[i] = (QLayer) {
+            .n = e->n,
+            .m = e->m,
+            .kp = qnn_align(e->m),
+            .in_scale = e->in_scale,
+            .in_zero = e->in_zero,
+            .act = e->act,
+        };
+    }
+    q = qnn_carve(q);
+
+    for (size_t i = 0; i < q.len; i++) {
+        const QNNLayerEntry *e = &table[i];
+        QLayer l = q.l[i];
+        memcpy(l.w, (const char *) map + e->w, l.n * l.kp);
+        memcpy(l.scale, (const char *) map + e->scale, l.n * sizeof(float));
+        memcpy(l.b, (const char *) map + e->b, l.n * sizeof(float));
+        qlay_wsum(l);
+    }
+
+    munmap(map, len);
+    return q;
+}
+
+// Frees the memory used by q.
+void qnn_del(QNN q) {
+    free(q.l);
+    free(q.params);
+    if (q.buf) {
+        free(q.buf->xq);
+        free(q.buf->a[0]);
+        free(q.buf->a[1]);
+        free(q.buf);
+    }
+}
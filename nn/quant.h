@@ -0,0 +1,84 @@
+#ifndef __QUANT_H__
+#define __QUANT_H__
+
+#include "layer.h"
+#include "set.h"
+#include "threadpool.h"
+#include <stdint.h>
+
+// Int8 inference. The weights of every layer are int8 with one
+// scale per output channel, w = scale[i] * q, and its inputs
+// are uint8 with a scale and zero point calibrated from the
+// range they took on a sample set, x = in_scale * (q - in_zero).
+// Products accumulate exactly in int32 and are turned back to
+// fp32 with the bias and the activation applied, so the
+// outputs of the network are fp32.
+#define QNN_ALIGN 64
+
+// Rows of w hold kp entries, m rounded up to QNN_ALIGN and
+// padded with zeros, so kernels never handle tails. wsum
+// holds the sum of every row to take the zero point out.
+typedef struct QLayer {
+    size_t n, m, kp;
+    int8_t *w;
+    float *scale, *b;
+    int32_t *wsum;
+    float in_scale;
+    int32_t in_zero;
+    enum ACT_FUNC act;
+} QLayer;
+
+// Scratch space of the forward pass, the quantized inputs
+// and two fp32 buffers the layers take turns writing.
+typedef struct QBuf {
+    uint8_t *xq;
+    float *a[2];
+    size_t cap;
+} QBuf;
+
+// Every layer is taken from one block, params.
+typedef struct QNN {
+    size_t xs, len;
+    QLayer *l;
+    void *params;
+    QBuf *buf;
+} QNN;
+
+// Quantized model file. A 64 byte header, a table with one
+// entry per layer and the weights, scales and biases of every
+// layer, each one at a 64 byte aligned offset.
+#define QNN_MAGIC "NNQUANT\0"
+#define QNN_VERSION 1
+#define QNN_ENDIAN 0x01020304u
+
+typedef struct QNNHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t endian;
+    uint64_t xs, len;
+    uint64_t table;
+    uint64_t size;
+    uint8_t reserved[16];
+} QNNHeader;
+
+typedef struct QNNLayerEntry {
+    uint32_t act;
+    int32_t in_zero;
+    float in_scale;
+    uint32_t reserved0;
+    uint64_t n, m;
+    uint64_t w, scale, b;
+    uint8_t reserved[8];
+} QNNLayerEntry;
+
+QNN qnn_new(size_t xs, const Layer *l, size_t len, const float *lo, const float *hi);
+void qnn_reserve(QNN q, size_t cols);
+Mat qnn_forward(QNN q, Set x);
+Mat qnn_forward_par(QNN q, ThreadPool *pool, Set x);
+void qnn_save(QNN q, const char *path);
+QNN qnn_from(const char *path);
+size_t qnn_size(QNN q);
+const char *qnn_kernel_name(void);
+void qnn_del(QNN q);
+
+#endif // __QUANT_H__
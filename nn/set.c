@@ -4,65 +4,392 @@
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+_Static_assert(sizeof(NNSetHeader) == NNSET_ALIGN, "NNSetHeader must be 64 bytes");
 
 // Asserts s is a valid set.
 static void set_assert(Set s) {
     assert(s.data != NULL);
 }
 
-// Returns an empty set.
-static Set set_new(size_t n, size_t m) {
+// Returns an empty set of the given dtype.
+static Set set_new_as(size_t n, size_t m, enum MAT_DTYPE dtype) {
+    MAT_TYPE *data = calloc(n*m, dtype_size(dtype));
     Set s = {
-        .data = calloc(n*m, sizeof(double)),
-        .free_ptr = s.data,
+        .data = data,
+        .free_ptr = data,
         .n = n,
         .m = m,
         .stride = m,
+        .dtype = dtype,
     };
 
     set_assert(s);
     return s;
 }
 
-// Returns a set made from a CSV file.
-Set set_from_csv(const char *csv, const char *sep) {
-    FILE *f = fopen(csv, "r");
-    assert(f != NULL);
+// Returns an empty set.
+static Set set_new(size_t n, size_t m) {
+    return set_new_as(n, m, MAT_F32);
+}
+
+// Returns a pointer to the (i,j) entry of s.
+static MAT_TYPE *set_ptr(Set s, size_t i, size_t j) {
+    return (MAT_TYPE *) ((char *) s.data + (i*s.stride + j) * dtype_size(s.dtype));
+}
+
+// A slice of whole lines of the file and the rows parsed from it.
+typedef struct CsvChunk {
+    const char *begin, *end;
+    const CsvSep *sep;
+    size_t m;
+    MAT_TYPE *rows;
+    size_t n, cap;
+} CsvChunk;
+
+static const double pow10_table[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+    1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+    1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+static bool is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Parses the number at [p,end) into out. Returns the end of the
+// number or p if there's none. Plain decimals are parsed here,
+// anything else (nan, inf, hex) goes through strtof.
+static const char *parse_float(const char *p, const char *end, MAT_TYPE *out) {
+    const char *start = p;
+    bool neg = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        neg = *p++ == '-';
 
-    size_t n = 0, m = 0;
-    char buffer[4096];
-    while (fscanf(f, "%s", buffer) == 1) {
-        char *token = strtok(buffer, sep);
-        while (token != NULL) {
-            if (n == 0) m++;
-            token = strtok(NULL, sep);
+    uint64_t mant = 0;
+    int exp10 = 0, digits = 0;
+    for (; p < end && is_digit(*p); p++, digits++) {
+        if (mant < UINT64_MAX / 10 - 9) mant = mant * 10 + (*p - '0');
+        else exp10++;
+    }
+
+    if (p < end && *p == '.') {
+        for (p++; p < end && is_digit(*p); p++, digits++) {
+            if (mant < UINT64_MAX / 10 - 9) {
+                mant = mant * 10 + (*p - '0');
+                exp10--;
+            }
         }
+    }
 
-        n++;
+    if (digits == 0) {
+        char buff[32];
+        size_t len = end - start < 31 ? end - start : 31;
+        memcpy(buff, start, len);
+        buff[len] = '\0';
+        char *e;
+        *out = strtof(buff, &e);
+        return start + (e - buff);
     }
 
-    Set s = set_new(n, m);
-    rewind(f);
-    for (size_t i = 0; i < n; i++) {
-        if (fscanf(f, "%s", buffer) != 1) {
-            perror("Error reading CSV file\n");
-            set_del(s);
-            exit(1);
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        bool eneg = false;
+        if (q < end && (*q == '-' || *q == '+'))
+            eneg = *q++ == '-';
+        if (q < end && is_digit(*q)) {
+            int e = 0;
+            for (; q < end && is_digit(*q); q++)
+                if (e < 10000) e = e * 10 + (*q - '0');
+            exp10 += eneg ? -e : e;
+            p = q;
+        }
+    }
+
+    double v = (double) mant;
+    if (exp10 < 0 && exp10 >= -22) v /= pow10_table[-exp10];
+    else if (exp10 > 0 && exp10 <= 22) v *= pow10_table[exp10];
+    else if (exp10 != 0) v *= pow(10, exp10);
+
+    *out = (MAT_TYPE) (neg ? -v : v);
+    return p;
+}
+
+// Returns the end of the line starting at p, without the '\n'.
+static const char *line_end(const char *p, const char *end) {
+    const char *nl = memchr(p, '\n', end - p);
+    return nl ? nl : end;
+}
+
+static bool line_empty(const char *p, const char *eol) {
+    while (p < eol && is_blank(*p)) p++;
+    return p == eol;
+}
+
+// Returns the lookup table of the chars of sep.
+CsvSep set_csv_sep(const char *sep) {
+    CsvSep seps = {0};
+    for (const char *c = sep; *c; c++)
+        seps.is[(unsigned char) *c] = true;
+    return seps;
+}
+
+// Parses m fields of the line [p,eol) into row. Empty fields and
+// missing trailing fields are set to SET_CSV_MISSING, extra fields
+// are ignored. Returns false if a field isn't a number.
+bool set_csv_row(const char *p, const char *eol, const CsvSep *sep,
+                 MAT_TYPE *row, size_t m) {
+    bool numeric = true;
+    for (size_t j = 0; j < m; j++) {
+        while (p < eol && is_blank(*p) && !sep->is[(unsigned char) *p]) p++;
+
+        row[j] = SET_CSV_MISSING;
+        if (p < eol && !sep->is[(unsigned char) *p]) {
+            const char *q = parse_float(p, eol, &row[j]);
+            numeric &= q != p;
+            p = q;
         }
 
-        char *token = strtok(buffer, sep);
-        for (size_t j = 0; j < m; j++) {
-            SET_AT(s, i, j) = atof(token);
-            token = strtok(NULL, sep);
+        while (p < eol && !sep->is[(unsigned char) *p]) {
+            numeric &= is_blank(*p);
+            p++;
         }
+
+        if (p < eol) p++;
     }
 
-    fclose(f);
+    return numeric;
+}
+
+// Counts the fields of the line [p,eol).
+size_t set_csv_fields(const char *p, const char *eol, const CsvSep *sep) {
+    size_t m = 1;
+    for (; p < eol; p++)
+        m += sep->is[(unsigned char) *p];
+    return m;
+}
+
+static void parse_chunk(CsvChunk *c) {
+    for (const char *p = c->begin; p < c->end; ) {
+        const char *eol = line_end(p, c->end);
+        if (!line_empty(p, eol)) {
+            if (c->n == c->cap) {
+                c->cap = c->cap ? c->cap * 2 : 1024;
+                c->rows = realloc(c->rows, sizeof(MAT_TYPE) * c->cap * c->m);
+                assert(c->rows != NULL);
+            }
+
+            set_csv_row(p, eol, c->sep, &c->rows[c->n * c->m], c->m);
+            c->n++;
+        }
+
+        p = eol + 1;
+    }
+}
+
+static void parse_chunks(size_t begin, size_t end, void *ctx) {
+    CsvChunk *chunks = ctx;
+    for (size_t i = begin; i < end; i++)
+        parse_chunk(&chunks[i]);
+}
+
+// Returns a set made from a CSV file. The file is mapped and split at
+// line boundaries in one chunk per core, every chunk being parsed on
+// its own thread. A first line that isn't numeric is taken as a header
+// and skipped, blank lines are skipped and missing values are set to
+// SET_CSV_MISSING. Every char of sep separates fields.
+Set set_from_csv(const char *csv, const char *sep) {
+    int fd = open(csv, O_RDONLY);
+    assert(fd != -1);
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("Error reading CSV file");
+        close(fd);
+        exit(1);
+    }
+
+    size_t len = st.st_size;
+    const char *text = len ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+    close(fd);
+    if (text == MAP_FAILED) {
+        perror("Error mapping CSV file");
+        exit(1);
+    }
+
+    CsvSep seps = set_csv_sep(sep);
+
+    // Find the first data line, skipping a header.
+    const char *p = text, *end = text + len;
+    size_t m = 0;
+    for (bool header = true; p < end && m == 0; ) {
+        const char *eol = line_end(p, end);
+        if (!line_empty(p, eol)) {
+            size_t fields = set_csv_fields(p, eol, &seps);
+            MAT_TYPE *row = malloc(sizeof(MAT_TYPE) * fields);
+            assert(row != NULL);
+            if (set_csv_row(p, eol, &seps, row, fields) || !header) m = fields;
+            else p = eol + 1;
+            header = false;
+            free(row);
+        } else {
+            p = eol + 1;
+        }
+    }
+
+    size_t parts = 1;
+    if ((size_t) (end - p) > SET_CSV_CHUNK) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        parts = cores > 0 ? cores : 1;
+        size_t max = (end - p) / SET_CSV_CHUNK;
+        parts = parts < max ? parts : max;
+    }
+
+    CsvChunk *chunks = malloc(sizeof(CsvChunk) * parts);
+    assert(chunks != NULL);
+    const char *from = p;
+    for (size_t i = 0; i < parts; i++) {
+        const char *to = i + 1 == parts ? end : p + (end - p) * (i + 1) / parts;
+        if (to < from) to = from;
+        if (to < end) {
+            // The last line may not end in '\n'.
+            const char *eol = line_end(to, end);
+            to = eol < end ? eol + 1 : end;
+        }
+        chunks[i] = (CsvChunk) { .begin = from, .end = to, .sep = &seps, .m = m };
+        from = to;
+    }
+
+    ThreadPool *pool = parts > 1 ? thpool_new(parts - 1) : NULL;
+    thpool_parallel_for(pool, 0, parts, 1, parse_chunks, chunks);
+    thpool_del(pool);
+
+    size_t n = 0;
+    for (size_t i = 0; i < parts; i++)
+        n += chunks[i].n;
+
+    Set s = set_new(n, m);
+    MAT_TYPE *dst = s.data;
+    for (size_t i = 0; i < parts; i++) {
+        if (chunks[i].n > 0)
+            memcpy(dst, chunks[i].rows, sizeof(MAT_TYPE) * chunks[i].n * m);
+        dst += chunks[i].n * m;
+        free(chunks[i].rows);
+    }
+
+    free(chunks);
+    if (len) munmap((void *) text, len);
     return s;
 }
 
+// Returns whether the rows of h fit in a file of len bytes,
+// dividing instead of multiplying so no size overflows.
+static bool nnset_fits(const NNSetHeader *h, size_t len) {
+    if (h->offset > len) return false;
+    size_t room = (len - h->offset) / dtype_size(h->dtype);
+    return h->m == 0 || (h->m <= room && h->n <= room / h->m);
+}
+
+// Maps a .nnset file into memory and returns a set whose data
+// points straight into the mapping, the file isn't read until
+// its pages are touched. The mapping is private so the set can
+// be shuffled in place without modifying the file. xs is set to
+// the amount of input cols when it's not NULL.
+// The returned Set needs to be free'd using set_del().
+Set set_from_nnset(const char *path, size_t *xs) {
+    int fd = open(path, O_RDONLY);
+    assert(fd != -1);
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t) st.st_size < sizeof(NNSetHeader)) {
+        fprintf(stderr, "Error reading nnset %s\n", path);
+        close(fd);
+        exit(1);
+    }
+
+    size_t len = st.st_size;
+    void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("Error mapping nnset");
+        exit(1);
+    }
+
+    NNSetHeader *h = map;
+    if (memcmp(h->magic, NNSET_MAGIC, sizeof(h->magic)) != 0
+        || h->version != NNSET_VERSION
+        || h->endian != NNSET_ENDIAN
+        || h->dtype > NNSET_F16
+        || h->xs > h->m
+        || h->offset % NNSET_ALIGN != 0
+        || !nnset_fits(h, len)) {
+        fprintf(stderr, "Invalid nnset %s\n", path);
+        munmap(map, len);
+        exit(1);
+    }
+
+    if (xs) *xs = h->xs;
+    return (Set) {
+        .data = (MAT_TYPE *) ((char *) map + h->offset),
+        .free_ptr = NULL,
+        .n = h->n,
+        .m = h->m,
+        .stride = h->m,
+        .dtype = h->dtype,
+        .map = map,
+        .map_len = len,
+    };
+}
+
+// Saves s to a .nnset file, the first xs cols being the inputs.
+// Rows are written in the dtype of s.
+void set_save_nnset(Set s, size_t xs, const char *path) {
+    assert(xs <= s.m);
+    FILE *f = fopen(path, "wb");
+    assert(f != NULL);
+
+    NNSetHeader h = {
+        .magic = NNSET_MAGIC,
+        .version = NNSET_VERSION,
+        .endian = NNSET_ENDIAN,
+        .dtype = s.dtype,
+        .xs = xs,
+        .n = s.n,
+        .m = s.m,
+        .offset = sizeof(NNSetHeader),
+    };
+
+    size_t written = fwrite(&h, sizeof(h), 1, f);
+    for (size_t i = 0; i < s.n; i++)
+        written += fwrite(set_ptr(s, i, 0), dtype_size(s.dtype), s.m, f) == s.m;
+
+    if (written != s.n + 1) {
+        fprintf(stderr, "Error saving nnset %s\n", path);
+        fclose(f);
+        exit(1);
+    }
+
+    fclose(f);
+}
+
+// Converts a CSV file into a .nnset file.
+void set_csv_to_nnset(const char *csv, const char *sep, size_t xs, const char *path) {
+    Set s = set_from_csv(csv, sep);
+    set_save_nnset(s, xs, path);
+    set_del(s);
+}
+
 // Returns a set made from a C style matrix.
 Set set_from(size_t n, size_t m, double data[n][m]) {
     Set s = set_new(n, m);
@@ -76,11 +403,12 @@ Set set_from(size_t n, size_t m, double data[n][m]) {
 // The returned Set doesn't need to be free'd using set_del().
 Set set_row(Set s, size_t i) {
     return (Set) {
-        .data = &SET_AT(s, i, 0),
+        .data = set_ptr(s, i, 0),
         .free_ptr = NULL,
         .n = 1,
         .m = s.m,
         .stride = s.stride,
+        .dtype = s.dtype,
     };
 }
 
@@ -88,11 +416,12 @@ Set set_row(Set s, size_t i) {
 // The returned Set doesn't need to be free'd using set_del().
 Set set_col(Set s, size_t j) {
     return (Set) {
-        .data = &SET_AT(s, 0, j),
+        .data = set_ptr(s, 0, j),
         .free_ptr = NULL,
         .n = s.n,
         .m = 1,
-        .stride = s.m,
+        .stride = s.stride,
+        .dtype = s.dtype,
     };
 }
 
@@ -104,7 +433,8 @@ Set set_get_x(Set s, size_t i) {
         .free_ptr = NULL,
         .n = s.n,
         .m = i,
-        .stride = s.m,
+        .stride = s.stride,
+        .dtype = s.dtype,
     };
 }
 
@@ -112,11 +442,12 @@ Set set_get_x(Set s, size_t i) {
 // The returned Set doesn't need to be free'd using set_del().
 Set set_get_y(Set s, size_t i) {
     return (Set) {
-        .data = &SET_AT(s, 0, i),
+        .data = set_ptr(s, 0, i),
         .free_ptr = NULL,
         .n = s.n,
         .m = s.m - i,
-        .stride = s.m,
+        .stride = s.stride,
+        .dtype = s.dtype,
     };
 }
 
@@ -126,33 +457,59 @@ Set set_batch(Set s, size_t from, size_t to) {
     assert(from <= to);
     to = to < s.n ? to : s.n;
     return (Set) {
-        .data = &SET_AT(s, from, 0),
+        .data = set_ptr(s, from, 0),
         .free_ptr = NULL,
         .n = to - from,
         .m = s.m,
         .stride = s.stride,
+        .dtype = s.dtype,
     };
 }
 
-// Shuffles the given set and returns it.
+// Shuffles the given set and returns it. Rows are
+// swapped as raw bytes so every dtype is kept as is.
 Set set_shuffle(Set s) {
+    size_t row = s.m * dtype_size(s.dtype);
     for (size_t i = 0; i < s.n; i++) {
         size_t j = (rand() % (s.n - i)) + i;
-        for (size_t k = 0; k < s.m; k++) {
-            double tmp = SET_AT(s, i, k);
-            SET_AT(s, i, k) = SET_AT(s, j, k);
-            SET_AT(s, j, k) = tmp;
+        unsigned char *a = (unsigned char *) set_ptr(s, i, 0);
+        unsigned char *b = (unsigned char *) set_ptr(s, j, 0);
+        for (size_t k = 0; k < row; k++) {
+            unsigned char tmp = a[k];
+            a[k] = b[k];
+            b[k] = tmp;
         }
     }
 
     return s;
 }
 
-// Copies src into dst and returns it.
+// Returns a copy of s.
+// The returned Set needs to be free'd using set_del().
+Set set_clone(Set s) {
+    return set_copy(set_new_as(s.n, s.m, s.dtype), s);
+}
+
+// Returns a copy of s stored as dtype.
+// The returned Set needs to be free'd using set_del().
+Set set_as(Set s, enum MAT_DTYPE dtype) {
+    return set_copy(set_new_as(s.n, s.m, dtype), s);
+}
+
+// Copies src into dst, converting between their
+// dtypes, and returns it.
 Set set_copy(Set dst, Set src) {
     for (size_t i = 0; i < src.n; i++) {
-        for (size_t j = 0; j < src.m; j++) {
-            SET_AT(dst, i, j) = SET_AT(src, i, j);
+        if (dst.dtype == src.dtype) {
+            memcpy(set_ptr(dst, i, 0), set_ptr(src, i, 0), src.m * dtype_size(src.dtype));
+        } else if (dst.dtype == MAT_F32) {
+            dtype_to_f32(src.dtype, set_ptr(dst, i, 0), set_ptr(src, i, 0), src.m);
+        } else if (src.dtype == MAT_F32) {
+            dtype_from_f32(dst.dtype, set_ptr(dst, i, 0), set_ptr(src, i, 0), src.m);
+        } else {
+            for (size_t j = 0; j < src.m; j++)
+                dtype_set(dst.data, i*dst.stride + j, dst.dtype,
+                          dtype_get(src.data, i*src.stride + j, src.dtype));
         }
     }
 
@@ -166,7 +523,7 @@ void set_print_with_str(Set s, const char *str, size_t from, size_t to) {
     for (size_t i = from; i < to; i++) {
         printf(BLACK"[  ");
         for (size_t j = 0; j < s.m; j++) {
-            double v = SET_AT(s, i, j);
+            double v = dtype_get(s.data, i*s.stride + j, s.dtype);
             snprintf(buff, 6, "%.3lf", fabs(v));
             printf(v < 0 ? RED"%s  " : (v == 0 ? WHITE"%s  " : GREEN"%s  "), buff);
         }
@@ -175,7 +532,8 @@ void set_print_with_str(Set s, const char *str, size_t from, size_t to) {
     puts(WHITE);
 }
 
-// Frees s.
+// Frees s, unmapping it if it was loaded from a .nnset file.
 void set_del(Set s) {
     free(s.free_ptr);
+    if (s.map) munmap(s.map, s.map_len);
 }
@@ -3,12 +3,53 @@
 
 #include "matrix.h"
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
 
+// Rows are stored as dtype, fp32 unless set. SET_AT only
+// works on fp32 sets while views, shuffles and copies take
+// any dtype.
 typedef struct Set {
     MAT_TYPE *data, *free_ptr;
     size_t n, m, stride;
+    enum MAT_DTYPE dtype;
+    void *map;
+    size_t map_len;
 } Set;
 
+// CSV loading params. Files are split in chunks of at
+// least SET_CSV_CHUNK bytes, one per thread, and empty
+// values are read as SET_CSV_MISSING.
+#define SET_CSV_CHUNK (1 << 20)
+#define SET_CSV_MISSING 0.0f
+
+// Separator lookup table.
+typedef struct CsvSep {
+    bool is[256];
+} CsvSep;
+
+// Binary dataset file, a 64 byte header followed by
+// the rows of the set starting at a 64 byte aligned
+// offset. The first xs cols of every row are inputs.
+#define NNSET_MAGIC "NNSET\0\0\0"
+#define NNSET_VERSION 1
+#define NNSET_ENDIAN 0x01020304u
+#define NNSET_ALIGN 64
+
+// Mirrors enum MAT_DTYPE.
+enum NNSET_DTYPE { NNSET_F32, NNSET_BF16, NNSET_F16 };
+
+typedef struct NNSetHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t endian;
+    uint32_t dtype;
+    uint32_t xs;
+    uint64_t n, m;
+    uint64_t offset;
+    uint8_t reserved[16];
+} NNSetHeader;
+
 // Gives an entry point to specific data in the set.
 #define SET_AT(set, i, j) (set).data[(i)*(set).stride+(j)]
 
@@ -35,6 +76,12 @@ typedef struct Set {
 
 Set set_from(size_t n, size_t m, double data[n][m]);
 Set set_from_csv(const char *csv, const char *sep);
+Set set_from_nnset(const char *path, size_t *xs);
+void set_save_nnset(Set s, size_t xs, const char *path);
+void set_csv_to_nnset(const char *csv, const char *sep, size_t xs, const char *path);
+CsvSep set_csv_sep(const char *sep);
+size_t set_csv_fields(const char *p, const char *eol, const CsvSep *sep);
+bool set_csv_row(const char *p, const char *eol, const CsvSep *sep, MAT_TYPE *row, size_t m);
 Set set_row(Set s, size_t i);
 Set set_col(Set s, size_t j);
 Set set_get_x(Set s, size_t i);
@@ -42,6 +89,8 @@ Set set_get_y(Set s, size_t i);
 Set set_batch(Set s, size_t from, size_t to);
 Set set_shuffle(Set s);
 Set set_copy(Set dst, Set src);
+Set set_clone(Set s);
+Set set_as(Set s, enum MAT_DTYPE dtype);
 void set_print_with_str(Set s, const char *str, size_t u, size_t v);
 void set_del(Set s);
 
@@ -0,0 +1,131 @@
+#include "stream.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Returns whether the line of len chars is blank.
+static bool line_blank(const char *line, size_t len) {
+    return strspn(line, " \t\r\n") >= len;
+}
+
+// Counts the fields of the first data line of f, skipping
+// blank lines and a first line that isn't numeric, the
+// same ones set_from_csv() skips. Leaves f at the start
+// of the data and sets start to its offset.
+static size_t count_cols(FILE *f, const CsvSep *sep, long *start) {
+    char *line = NULL;
+    size_t cap = 0, m = 0;
+    ssize_t len;
+    bool header = true;
+    *start = ftell(f);
+
+    while (m == 0 && (len = getline(&line, &cap, f)) > 0) {
+        if (line_blank(line, len)) {
+            *start = ftell(f);
+            continue;
+        }
+
+        const char *eol = line + len - (line[len-1] == '\n');
+        size_t fields = set_csv_fields(line, eol, sep);
+        MAT_TYPE *row = malloc(sizeof(MAT_TYPE) * fields);
+        assert(row != NULL);
+        if (set_csv_row(line, eol, sep, row, fields) || !header) m = fields;
+        else *start = ftell(f);
+        header = false;
+        free(row);
+    }
+
+    free(line);
+    fseek(f, *start, SEEK_SET);
+    return m;
+}
+
+// Reads the next chunk into the buffer being prefetched and shuffles it.
+static void stream_load(void *arg) {
+    SetStream *s = arg;
+    Set *dst = &s->buf[s->next];
+    char *line = NULL;
+    size_t cap = 0, n = 0;
+
+    ssize_t len;
+    while (n < s->chunk && (len = getline(&line, &cap, s->f)) > 0) {
+        if (line_blank(line, len)) continue;
+        const char *eol = line + len - (line[len-1] == '\n');
+        set_csv_row(line, eol, &s->sep, &SET_AT(*dst, n, 0), s->m);
+        n++;
+    }
+
+    free(line);
+    dst->n = n;
+    if (n > 0) set_shuffle(*dst);
+}
+
+static void stream_prefetch(SetStream *s) {
+    thpool_join_init(&s->join);
+    if (thpool_spawn_join(s->loader, &s->join, stream_load, s))
+        stream_load(s);
+    s->loading = true;
+}
+
+// Opens a stream over a CSV file that hands out
+// chunks of at most `chunk` rows. Its lines are
+// parsed like the ones of set_from_csv().
+SetStream *stream_new(const char *csv, const char *sep, size_t chunk) {
+    assert(chunk > 0);
+    SetStream *s = calloc(1, sizeof(SetStream));
+    assert(s != NULL);
+
+    s->f = fopen(csv, "r");
+    assert(s->f != NULL);
+    s->sep = set_csv_sep(sep);
+    s->m = count_cols(s->f, &s->sep, &s->start);
+    s->chunk = chunk;
+    assert(s->m > 0);
+
+    for (size_t i = 0; i < 2; i++) {
+        MAT_TYPE *data = calloc(chunk * s->m, sizeof(MAT_TYPE));
+        assert(data != NULL);
+        s->buf[i] = (Set) {
+            .data = data,
+            .free_ptr = data,
+            .n = 0,
+            .m = s->m,
+            .stride = s->m,
+        };
+    }
+
+    s->loader = thpool_new(1);
+    return s;
+}
+
+// Returns the next shuffled chunk of the file and starts
+// reading the following one. The chunk stays valid until
+// the next call. An empty set marks the end of the file.
+Set stream_next(SetStream *s) {
+    if (!s->loading) stream_prefetch(s);
+    thpool_join(s->loader, &s->join);
+    s->loading = false;
+
+    Set chunk = s->buf[s->next];
+    s->next = !s->next;
+    if (chunk.n > 0) stream_prefetch(s);
+    return chunk;
+}
+
+// Goes back to the first row of the file.
+void stream_rewind(SetStream *s) {
+    if (s->loading) thpool_join(s->loader, &s->join);
+    s->loading = false;
+    fseek(s->f, s->start, SEEK_SET);
+}
+
+// Closes the stream and frees its buffers.
+void stream_del(SetStream *s) {
+    stream_rewind(s);
+    thpool_del(s->loader);
+    set_del(s->buf[0]);
+    set_del(s->buf[1]);
+    fclose(s->f);
+    free(s);
+}
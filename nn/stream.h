@@ -0,0 +1,30 @@
+#ifndef __STREAM_H__
+#define __STREAM_H__
+
+#include "set.h"
+#include "threadpool.h"
+#include <stdio.h>
+#include <stdbool.h>
+
+// Reads a CSV file in chunks of a fixed amount of rows, so a
+// dataset of any size is trained with constant memory. While
+// a chunk is handed out the next one is read and shuffled by
+// a background thread.
+typedef struct SetStream {
+    FILE *f;
+    long start;
+    CsvSep sep;
+    size_t m, chunk;
+    Set buf[2];
+    size_t next;
+    ThreadPool *loader;
+    Join join;
+    bool loading;
+} SetStream;
+
+SetStream *stream_new(const char *csv, const char *sep, size_t chunk);
+Set stream_next(SetStream *s);
+void stream_rewind(SetStream *s);
+void stream_del(SetStream *s);
+
+#endif // __STREAM_H__
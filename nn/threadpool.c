@@ -2,133 +2,356 @@
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
+#include <sched.h>
+
+// Chase-Lev work-stealing deque of fixed capacity. The owner
+// pushes and pops at the bottom, thieves take from the top.
+typedef struct Deque {
+    _Atomic int64_t top;
+    _Atomic int64_t bottom;
+    Task *buf;
+} Deque;
+
+// Slot of the inject queue, seq tells whether it's free.
+typedef struct Slot {
+    atomic_size_t seq;
+    Task task;
+} Slot;
+
+// Bounded multi-producer multi-consumer queue.
+typedef struct Inject {
+    atomic_size_t head;
+    atomic_size_t tail;
+    Slot *slots;
+} Inject;
+
+// A loop split in halves until every range has
+// at most grain iterations.
+typedef struct RangeFor {
+    RangeJob body;
+    void *ctx;
+    size_t grain;
+    Join join;
+} RangeFor;
+
+typedef struct ThWorker {
+    pthread_t thread;
+    ThreadPool *pool;
+    Deque deque;
+    uint64_t rng;
+} ThWorker;
+
+// Worker running on this thread, if any.
+static _Thread_local ThWorker *self;
+
+static inline void
+cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+// Slots are read by thieves while the owner may be writing
+// them. A torn read is always discarded by the CAS on top,
+// the fields are accessed atomically to keep it well defined.
+static inline void
+slot_store(Task *slot, Task task)
+{
+    __atomic_store_n(&slot->func, task.func, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->arg, task.arg, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->join, task.join, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->range, task.range, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->begin, task.begin, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->end, task.end, __ATOMIC_RELAXED);
+}
+
+static inline Task
+slot_load(Task *slot)
+{
+    return (Task) {
+        .func = __atomic_load_n(&slot->func, __ATOMIC_RELAXED),
+        .arg = __atomic_load_n(&slot->arg, __ATOMIC_RELAXED),
+        .join = __atomic_load_n(&slot->join, __ATOMIC_RELAXED),
+        .range = __atomic_load_n(&slot->range, __ATOMIC_RELAXED),
+        .begin = __atomic_load_n(&slot->begin, __ATOMIC_RELAXED),
+        .end = __atomic_load_n(&slot->end, __ATOMIC_RELAXED),
+    };
+}
 
-static Task *
-task_new(Job func, void *arg)
+static int
+deque_init(Deque *deque)
 {
-    Task *task = malloc(sizeof(Task));
-    if (!task) return NULL;
+    deque->buf = malloc(sizeof(Task) * THPOOL_DEQUE_SIZE);
+    if (!deque->buf) return 1;
 
-    task->func = func;
-    task->arg = arg;
-    return task;
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    return 0;
+}
 
+// Owner only. Returns false if the deque is full.
+static bool
+deque_push(Deque *deque, Task task)
+{
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (b - t >= THPOOL_DEQUE_SIZE) {
+        return false;
+    }
+
+    slot_store(&deque->buf[b & (THPOOL_DEQUE_SIZE - 1)], task);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    return true;
 }
 
-static void
-task_del(Task *task)
+// Owner only. Takes the most recently pushed task.
+static bool
+deque_pop(Deque *deque, Task *task)
 {
-    free(task);
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (t > b) {
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+        return false;
+    }
+
+    *task = slot_load(&deque->buf[b & (THPOOL_DEQUE_SIZE - 1)]);
+    if (t < b) {
+        return true;
+    }
+
+    // Last task, race thieves for it.
+    bool won = atomic_compare_exchange_strong_explicit(
+        &deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    return won;
+}
+
+// Any thread. Takes the oldest task.
+static bool
+deque_steal(Deque *deque, Task *task)
+{
+    int64_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (t >= b) {
+        return false;
+    }
+
+    *task = slot_load(&deque->buf[t & (THPOOL_DEQUE_SIZE - 1)]);
+    return atomic_compare_exchange_strong_explicit(
+        &deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed);
 }
 
-static Queue *
-queue_new(size_t n)
+static Inject *
+inject_new(void)
 {
-    Queue *queue = malloc(sizeof(Queue));
+    Inject *queue = malloc(sizeof(Inject));
     if (!queue) return NULL;
 
-    queue->vec = malloc(sizeof(Task) * n);
-    if (!queue->vec) {
+    queue->slots = malloc(sizeof(Slot) * THPOOL_INJECT_SIZE);
+    if (!queue->slots) {
         free(queue);
         return NULL;
     }
 
-    queue->len = 0;
-    queue->cap = n;
+    for (size_t i = 0; i < THPOOL_INJECT_SIZE; i++) {
+        atomic_init(&queue->slots[i].seq, i);
+    }
+
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
     return queue;
 }
 
-static int
-queue_resize(Queue *queue, size_t new_cap)
+// Returns false if the queue is full.
+static bool
+inject_push(Inject *queue, Task task)
 {
-    if (new_cap < queue->len) {
-        return -1;
+    size_t pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    Slot *slot;
+    while (1) {
+        slot = &queue->slots[pos & (THPOOL_INJECT_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->tail, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        }
     }
 
-    queue->vec = realloc(queue->vec, sizeof(Task) * new_cap);
-    queue->cap = new_cap;
-    return 0;
+    slot->task = task;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return true;
 }
 
-static int
-queue_push(Queue *queue, Task *task)
+// Returns false if the queue is empty.
+static bool
+inject_pop(Inject *queue, Task *task)
 {
-    if (queue->len == queue->cap) {
-        if (queue_resize(queue, QUEUE_RESIZE_COEF * queue->cap) == -1) {
-            return 1;
+    size_t pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    Slot *slot;
+    while (1) {
+        slot = &queue->slots[pos & (THPOOL_INJECT_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->head, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&queue->head, memory_order_relaxed);
         }
     }
 
-    queue->vec[queue->len++] = task;
-    return 0;
+    *task = slot->task;
+    atomic_store_explicit(&slot->seq, pos + THPOOL_INJECT_SIZE, memory_order_release);
+    return true;
+}
+
+static void
+inject_del(Inject *queue)
+{
+    free(queue->slots);
+    free(queue);
+}
+
+static uint64_t
+xorshift(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
 }
 
+// Looks for a task in the inject queue and then in the deques
+// of every worker, starting from a random one.
 static bool
-queue_empty(Queue *queue)
+take_shared(ThreadPool *pool, Task *task, uint64_t *rng)
 {
-    return queue->len == 0;
+    if (inject_pop(pool->inject, task)) {
+        return true;
+    }
+
+    size_t from = xorshift(rng) % pool->len;
+    for (size_t i = 0; i < pool->len; i++) {
+        ThWorker *victim = &pool->workers[(from + i) % pool->len];
+        if (deque_steal(&victim->deque, task)) {
+            return true;
+        }
+    }
+
+    return false;
 }
 
-static Task *
-queue_pop(Queue *queue)
+static bool
+take(ThreadPool *pool, Task *task, uint64_t *rng)
 {
-    if (queue_empty(queue)) {
-        return NULL;
+    if (self && self->pool == pool && deque_pop(&self->deque, task)) {
+        return true;
     }
 
-    Task *task = queue->vec[0];
-    queue->len--;
+    return take_shared(pool, task, rng);
+}
 
-    for (size_t i = 0; i < queue->len; i++) {
-        queue->vec[i] = queue->vec[i + 1];
+// Drops one task from the join. The last one marks it as done
+// under the lock, after that the join may go out of scope so
+// it's not touched anymore.
+static void
+join_release(ThreadPool *pool, Join *join)
+{
+    if (atomic_fetch_sub(&join->pending, 1) != 1) {
+        return;
     }
 
-    return task;
+    pthread_mutex_lock(&pool->work_lock);
+    bool parked = atomic_load(&join->parked);
+    atomic_store(&join->done, true);
+    if (parked) pthread_cond_broadcast(&pool->finished);
+    pthread_mutex_unlock(&pool->work_lock);
 }
 
+static void run_range(ThreadPool *pool, RangeFor *range, size_t begin, size_t end);
+
 static void
-queue_del(Queue *queue)
+run(ThreadPool *pool, Task task)
 {
-    for (size_t i = 0; i < queue->len; i++) {
-        task_del(queue->vec[i]);
+    atomic_fetch_add(&pool->running, 1);
+    if (task.range) run_range(pool, task.range, task.begin, task.end);
+    else task.func(task.arg);
+    atomic_fetch_sub(&pool->running, 1);
+
+    if (task.join) join_release(pool, task.join);
+
+    // Wake up the threads blocked in thpool_wait().
+    if (atomic_fetch_sub(&pool->pending, 1) == 1 && atomic_load(&pool->waiting) > 0) {
+        pthread_mutex_lock(&pool->work_lock);
+        pthread_cond_broadcast(&pool->finished);
+        pthread_mutex_unlock(&pool->work_lock);
     }
+}
 
-    free(queue->vec);
-    free(queue);
+static void
+wake_worker(ThreadPool *pool)
+{
+    atomic_fetch_add(&pool->epoch, 1);
+    if (atomic_load(&pool->sleeping) > 0) {
+        pthread_mutex_lock(&pool->work_lock);
+        pthread_cond_signal(&pool->new_task);
+        pthread_mutex_unlock(&pool->work_lock);
+    }
 }
 
 static void *
 __f(void *__send)
 {
-    ThreadPool *pool = (ThreadPool *) __send;
-    while (1) {
-        pthread_mutex_lock(&pool->work_lock);
-        while (queue_empty(pool->tasks) && !pool->exit) {
-            pthread_cond_wait(&pool->new_task, &pool->work_lock);
+    ThWorker *worker = (ThWorker *) __send;
+    ThreadPool *pool = worker->pool;
+    self = worker;
+
+    Task task;
+    while (!atomic_load(&pool->exit)) {
+        bool found = false;
+        for (size_t i = 0; i < THPOOL_SPIN && !found; i++) {
+            found = take(pool, &task, &worker->rng);
+            if (!found) cpu_relax();
         }
 
-        if (pool->exit) {
-            pthread_mutex_unlock(&pool->work_lock);
-            break;
+        if (found) {
+            run(pool, task);
+            continue;
         }
 
-        if (!queue_empty(pool->tasks)) {
-            pool->running++;
-
-            // Get task from queue.
-            Task *task = queue_pop(pool->tasks);
-            pthread_mutex_unlock(&pool->work_lock);
-
-            task->func(task->arg);
-            task_del(task);
-
-            // Decrement running tasks count.
-            pthread_mutex_lock(&pool->work_lock);
-            pool->running--;
+        // Park until a new task is spawned. The epoch is read
+        // before the last look so no spawn can be missed.
+        unsigned epoch = atomic_load(&pool->epoch);
+        if (take(pool, &task, &worker->rng)) {
+            run(pool, task);
+            continue;
         }
 
-        // Signal that this task has finished.
-        pthread_cond_signal(&pool->finished);
+        pthread_mutex_lock(&pool->work_lock);
+        atomic_fetch_add(&pool->sleeping, 1);
+        while (atomic_load(&pool->epoch) == epoch && !atomic_load(&pool->exit)) {
+            pthread_cond_wait(&pool->new_task, &pool->work_lock);
+        }
+        atomic_fetch_sub(&pool->sleeping, 1);
         pthread_mutex_unlock(&pool->work_lock);
     }
 
@@ -144,60 +367,186 @@ thpool_new(size_t nthreads)
     ThreadPool *pool = calloc(1, sizeof(ThreadPool));
     if (!pool) return NULL;
 
-    // Queue is the same size as the amount of workers.
-    Queue *tasks = queue_new(nthreads);
-    if (!tasks) {
+    Inject *inject = inject_new();
+    if (!inject) {
         free(pool);
         return NULL;
     }
 
-    pthread_t *workers = malloc(sizeof(pthread_t) * nthreads);
+    ThWorker *workers = calloc(nthreads, sizeof(ThWorker));
     if (!workers) {
-        queue_del(tasks);
+        inject_del(inject);
         free(pool);
         return NULL;
     }
 
+    for (size_t i = 0; i < nthreads; i++) {
+        if (deque_init(&workers[i].deque)) {
+            while (i--) free(workers[i].deque.buf);
+            free(workers);
+            inject_del(inject);
+            free(pool);
+            return NULL;
+        }
+
+        workers[i].pool = pool;
+        workers[i].rng = 0x9E3779B97F4A7C15ull * (i + 1);
+    }
+
     // Initialize pool.
-    *pool = (ThreadPool) {
-        .tasks = tasks,
-        .workers = workers,
-        .len = nthreads,
-    };
+    pool->workers = workers;
+    pool->inject = inject;
+    pool->len = nthreads;
+    atomic_init(&pool->pending, 0);
+    atomic_init(&pool->running, 0);
+    atomic_init(&pool->sleeping, 0);
+    atomic_init(&pool->waiting, 0);
+    atomic_init(&pool->epoch, 0);
+    atomic_init(&pool->exit, false);
 
     pthread_mutex_init(&pool->work_lock, NULL);
     pthread_cond_init(&pool->new_task, NULL);
     pthread_cond_init(&pool->finished, NULL);
 
     for (size_t i = 0; i < nthreads; i++) {
-        pthread_create(&pool->workers[i], NULL, __f, pool);
+        pthread_create(&workers[i].thread, NULL, __f, &workers[i]);
     }
 
     return pool;
 }
 
+// Queues task. Workers of the pool push to their own deque, other
+// threads push to the inject queue. Neither takes a lock unless
+// a worker is parked.
+static void
+submit(ThreadPool *pool, Task task)
+{
+    atomic_fetch_add(&pool->pending, 1);
+    if (task.join) atomic_fetch_add(&task.join->pending, 1);
+
+    if (!(self && self->pool == pool && deque_push(&self->deque, task))) {
+        // The inject queue is full, help draining it.
+        uint64_t rng = (uintptr_t) &task;
+        while (!inject_push(pool->inject, task)) {
+            Task other;
+            if (take(pool, &other, &rng)) run(pool, other);
+            else sched_yield();
+        }
+    }
+
+    wake_worker(pool);
+}
+
 // Assigns 'job' to the first available worker. Returns `0` on success and `1` on failure.
 int
 thpool_spawn(ThreadPool *pool, Job job, void *arg)
 {
-    if (!pool || !job || pool->exit)
+    if (!pool || !job || atomic_load(&pool->exit))
         return 1;
 
-    Task *task = task_new(job, arg);
-    if (!task) return 1;
+    submit(pool, (Task) { .func = job, .arg = arg });
+    return 0;
+}
 
-    pthread_mutex_lock(&pool->work_lock);
-    int res = queue_push(pool->tasks, task);
-    pthread_cond_signal(&pool->new_task);
-    pthread_mutex_unlock(&pool->work_lock);
-    return res;
+// Initializes an empty fork-join region.
+void
+thpool_join_init(Join *join)
+{
+    // The caller holds a reference until it joins.
+    atomic_init(&join->pending, 1);
+    atomic_init(&join->parked, false);
+    atomic_init(&join->done, false);
+}
+
+// Same as thpool_spawn() but the task is waited by thpool_join(pool, join).
+int
+thpool_spawn_join(ThreadPool *pool, Join *join, Job job, void *arg)
+{
+    if (!pool || !join || !job || atomic_load(&pool->exit))
+        return 1;
+
+    submit(pool, (Task) { .func = job, .arg = arg, .join = join });
+    return 0;
+}
+
+// Blocks until every task spawned on join is finished. The calling
+// thread runs pending tasks and then spins for a while before
+// parking, so short regions don't pay for a condvar round trip.
+// Safe to call from tasks of the same pool.
+void
+thpool_join(ThreadPool *pool, Join *join)
+{
+    if (!pool) return;
+    join_release(pool, join);
+
+    uint64_t rng = (uintptr_t) &rng;
+    Task task;
+    for (size_t spins = 0; !atomic_load(&join->done); spins++) {
+        if (take(pool, &task, &rng)) {
+            run(pool, task);
+            spins = 0;
+            continue;
+        }
+
+        if (spins < THPOOL_SPIN) {
+            cpu_relax();
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->work_lock);
+        atomic_store(&join->parked, true);
+        while (!atomic_load(&join->done)) {
+            pthread_cond_wait(&pool->finished, &pool->work_lock);
+        }
+        pthread_mutex_unlock(&pool->work_lock);
+    }
+}
+
+// Runs [begin,end) on the calling thread, handing its
+// right halves to the pool while it's bigger than grain.
+static void
+run_range(ThreadPool *pool, RangeFor *range, size_t begin, size_t end)
+{
+    while (end - begin > range->grain) {
+        size_t mid = begin + (end - begin) / 2;
+        submit(pool, (Task) {
+            .join = &range->join,
+            .range = range,
+            .begin = mid,
+            .end = end,
+        });
+        end = mid;
+    }
+
+    range->body(begin, end, range->ctx);
+}
+
+// Calls body on disjoint sub-ranges of [begin,end) of at most grain
+// iterations, in parallel, and returns once all of them are done.
+// Ranges are split recursively by whichever thread runs them, so
+// work spreads out in log(n) steps. Runs serially when pool is NULL.
+void
+thpool_parallel_for(ThreadPool *pool, size_t begin, size_t end,
+                    size_t grain, RangeJob body, void *ctx)
+{
+    if (begin >= end) return;
+    grain = grain > 0 ? grain : 1;
+    if (!pool || atomic_load(&pool->exit) || end - begin <= grain) {
+        body(begin, end, ctx);
+        return;
+    }
+
+    RangeFor range = { .body = body, .ctx = ctx, .grain = grain };
+    thpool_join_init(&range.join);
+    run_range(pool, &range, begin, end);
+    thpool_join(pool, &range.join);
 }
 
 // Returns the amount of running workers in the pool.
 size_t
 thpool_running(ThreadPool *pool)
 {
-    return pool ? pool->running : 0;
+    return pool ? atomic_load(&pool->running) : 0;
 }
 
 // Returns the amount of containing threads.
@@ -208,19 +557,37 @@ thpool_len(ThreadPool *pool)
 }
 
 // Will block the calling thread until every task
-// in the queue is finished.
+// in the queue is finished. The calling thread runs
+// pending tasks while it waits. Must not be called
+// from a task of the same pool, that task would
+// never stop being pending.
 void
 thpool_wait(ThreadPool *pool)
 {
     if (!pool) return;
 
-    pthread_mutex_lock(&pool->work_lock);
+    uint64_t rng = (uintptr_t) &rng;
+    Task task;
+    for (size_t spins = 0; atomic_load(&pool->pending) > 0; spins++) {
+        if (take(pool, &task, &rng)) {
+            run(pool, task);
+            spins = 0;
+            continue;
+        }
 
-    while (!queue_empty(pool->tasks) || thpool_running(pool) > 0) {
-        pthread_cond_wait(&pool->finished, &pool->work_lock);
-    }
+        if (spins < THPOOL_SPIN) {
+            cpu_relax();
+            continue;
+        }
 
-    pthread_mutex_unlock(&pool->work_lock);
+        pthread_mutex_lock(&pool->work_lock);
+        atomic_fetch_add(&pool->waiting, 1);
+        while (atomic_load(&pool->pending) > 0) {
+            pthread_cond_wait(&pool->finished, &pool->work_lock);
+        }
+        atomic_fetch_sub(&pool->waiting, 1);
+        pthread_mutex_unlock(&pool->work_lock);
+    }
 }
 
 // Prints the state of the pool.
@@ -231,15 +598,15 @@ thpool_show(ThreadPool *pool)
     if (!pool) return;
 
     printf("    running: %li\n", thpool_running(pool));
+    printf("    pending: %li\n", atomic_load(&pool->pending));
     printf("    len: %li\n", thpool_len(pool));
-    printf("    exit: %s\n", pool->exit ? "true" : "false");
-
-    Queue *queue = pool->tasks;
-    printf("queue: %p\n", queue);
-    if (!queue) return;
+    printf("    exit: %s\n", atomic_load(&pool->exit) ? "true" : "false");
 
-    printf("    tasks: %li\n", queue->len);
-    printf("    capacity: %li\n", queue->cap);
+    for (size_t i = 0; i < pool->len; i++) {
+        Deque *deque = &pool->workers[i].deque;
+        long len = atomic_load(&deque->bottom) - atomic_load(&deque->top);
+        printf("deque %li: %li tasks\n", i, len > 0 ? len : 0);
+    }
 }
 
 // Free's the memory used by 'pool'.
@@ -252,20 +619,22 @@ thpool_show(ThreadPool *pool)
 void
 thpool_del(ThreadPool *pool)
 {
-    if (!pool || pool->exit) return;
+    if (!pool || atomic_load(&pool->exit)) return;
 
     pthread_mutex_lock(&pool->work_lock);
-    pool->exit = true;
+    atomic_store(&pool->exit, true);
     pthread_cond_broadcast(&pool->new_task);
     pthread_mutex_unlock(&pool->work_lock);
 
     for (size_t i = 0; i < pool->len; i++) {
-        pthread_join(pool->workers[i], NULL);
+        pthread_join(pool->workers[i].thread, NULL);
+        free(pool->workers[i].deque.buf);
     }
 
     pthread_mutex_destroy(&pool->work_lock);
     pthread_cond_destroy(&pool->new_task);
     pthread_cond_destroy(&pool->finished);
-    queue_del(pool->tasks);
+    inject_del(pool->inject);
+    free(pool->workers);
     free(pool);
 }
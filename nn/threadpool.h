@@ -4,41 +4,64 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
 
-// Queue params.
-#define QUEUE_RESIZE_COEF 2
-#define QUEUE_SIZE_INIT 128
+// Pool params. Both sizes must be powers of 2.
+#define THPOOL_DEQUE_SIZE 4096
+#define THPOOL_INJECT_SIZE 4096
+#define THPOOL_SPIN 2048
 
 typedef void (*Job)(void *);
-typedef struct Queue Queue;
+typedef void (*RangeJob)(size_t begin, size_t end, void *ctx);
+typedef struct ThWorker ThWorker;
+typedef struct Inject Inject;
+typedef struct RangeFor RangeFor;
+
+// Counts the tasks of a fork-join region, so waiting on it
+// doesn't depend on any other task of the pool.
+typedef struct Join {
+    atomic_size_t pending;
+    atomic_bool parked;
+    atomic_bool done;
+} Join;
 
 typedef struct Task {
     Job func;
     void *arg;
+    Join *join;
+    RangeFor *range;
+    size_t begin, end;
 } Task;
 
-typedef struct Queue {
-    Task **vec;
-    size_t len;
-    size_t cap;
-} Queue;
-
+// Every worker owns a Chase-Lev deque, tasks spawned from a worker
+// go to its own deque and tasks spawned from other threads go to
+// the lock-free inject queue. Idle workers steal from the others.
 typedef struct ThreadPool {
-    pthread_t *workers;
+    ThWorker *workers;
+    Inject *inject;
     pthread_mutex_t work_lock;
     pthread_cond_t new_task;
     pthread_cond_t finished;
-    size_t running;
-    Queue *tasks;
+    atomic_size_t pending;
+    atomic_size_t running;
+    atomic_size_t sleeping;
+    atomic_size_t waiting;
+    atomic_uint epoch;
     size_t len;
-    bool exit;
+    atomic_bool exit;
 } ThreadPool;
 
 ThreadPool *thpool_new(size_t nthreads);
 int thpool_spawn(ThreadPool *pool, Job job, void *arg);
 void thpool_wait(ThreadPool *pool);
+void thpool_join_init(Join *join);
+int thpool_spawn_join(ThreadPool *pool, Join *join, Job job, void *arg);
+void thpool_join(ThreadPool *pool, Join *join);
+void thpool_parallel_for(ThreadPool *pool, size_t begin, size_t end,
+                         size_t grain, RangeJob body, void *ctx);
 size_t thpool_running(ThreadPool *pool);
 size_t thpool_len(ThreadPool *pool);
 void thpool_del(ThreadPool *pool);
 
-#endif // __THREADPOOL__
\ No newline at end of file
+#endif // __THREADPOOL__
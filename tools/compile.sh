@@ -0,0 +1,4 @@
+# !/bin/bash
+
+gcc nnc.c ../nn/*.o -O3 -g -lm -pthread -o nnc &&
+gcc nnserve.c ../nn/*.o -O3 -g -lm -pthread -o nnserve
@@ -0,0 +1,213 @@
+// Ahead-of-time compiler of models. Reads a model file and
+// writes a standalone C source that predicts with it, with the
+// weights as static const arrays and every dimension fixed.
+// Small layers are fully unrolled, bigger ones are written as
+// loops with constant bounds the compiler can vectorize.
+//
+//   nnc <model.nn> [-o out.c] [-n name]
+//
+// The source defines void name(const float *in, float *out),
+// predict by default, and NAME_INPUTS and NAME_OUTPUTS.
+#include "../nn/nn.h"
+#include <ctype.h>
+
+// Layers with more weights than this are written as loops.
+#define NNC_UNROLL_MAX 4096
+
+// The approximations of act.h, so the generated code doesn't
+// call libm and gives the same outputs as the library.
+static const char *act_prelude =
+    "static inline float nnc_exp(float x) {\n"
+    "    x = x < -87.3f ? -87.3f : x;\n"
+    "    x = x > 88.37f ? 88.37f : x;\n"
+    "    float t = x * 1.44269504088896341f + 12582912.0f;\n"
+    "    int32_t n;\n"
+    "    memcpy(&n, &t, sizeof(n));\n"
+    "    n -= 0x4b400000;\n"
+    "    float fn = t - 12582912.0f;\n"
+    "    float r = x - fn * 0.693359375f;\n"
+    "    r = r + fn * 2.12194440e-4f;\n"
+    "    float p = 1.9875691500e-4f;\n"
+    "    p = p * r + 1.3981999507e-3f;\n"
+    "    p = p * r + 8.3334519073e-3f;\n"
+    "    p = p * r + 4.1665795894e-2f;\n"
+    "    p = p * r + 1.6666665459e-1f;\n"
+    "    p = p * r + 5.0000001201e-1f;\n"
+    "    p = p * r * r + r + 1;\n"
+    "    int32_t bits = (n + 127) << 23;\n"
+    "    float scale;\n"
+    "    memcpy(&scale, &bits, sizeof(scale));\n"
+    "    return p * scale;\n"
+    "}\n\n"
+    "static inline float nnc_tanh(float x) {\n"
+    "    float s = x * x;\n"
+    "    float p = -5.70498872745e-3f;\n"
+    "    p = p * s + 2.06390887954e-2f;\n"
+    "    p = p * s - 5.37397155531e-2f;\n"
+    "    p = p * s + 1.33314422036e-1f;\n"
+    "    p = p * s - 3.33332819422e-1f;\n"
+    "    p = p * s * x + x;\n"
+    "    float ax = x < 0 ? -x : x;\n"
+    "    float t = 1 - 2 / (nnc_exp(2 * ax) + 1);\n"
+    "    t = x < 0 ? -t : t;\n"
+    "    return ax < 0.625f ? p : t;\n"
+    "}\n\n"
+    "static inline float nnc_sigmoid(float x) {\n"
+    "    return 1 / (1 + nnc_exp(-x));\n"
+    "}\n\n";
+
+static void usage(void) {
+    fprintf(stderr, "usage: nnc <model.nn> [-o out.c] [-n name]\n");
+    exit(1);
+}
+
+// Writes the expression applying act to the variable v.
+static void emit_act(FILE *f, enum ACT_FUNC act, const char *v) {
+    switch (act) {
+    case RELU:    fprintf(f, "(%s > 0.0f ? %s : 0.0f)", v, v); break;
+    case TANH:    fprintf(f, "nnc_tanh(%s)", v); break;
+    case SIGMOID: fprintf(f, "nnc_sigmoid(%s)", v); break;
+    default:      fprintf(f, "%s", v); break;
+    }
+}
+
+// Writes v so it reads back as the same float.
+static void emit_float(FILE *f, float v) {
+    fprintf(f, "%.9gf", v);
+}
+
+// Returns whether l is written as loops.
+static bool layer_loops(Layer l) {
+    return l.w.n * l.w.m > NNC_UNROLL_MAX;
+}
+
+// Writes the weights and biases of every layer. Layers written
+// as loops have their weights transposed, so the loop over the
+// outputs is the inner one and vectorizes without reordering
+// the sums.
+static void emit_weights(FILE *f, NN n) {
+    for (size_t i = 0; i < n.len; i++) {
+        Layer l = n.l[i];
+        Mat w = layer_loops(l) ? mat_t(l.w) : l.w;
+        fprintf(f, "static const float w%zu[%zu][%zu] = {\n", i, w.n, w.m);
+        for (size_t r = 0; r < w.n; r++) {
+            fprintf(f, "    {");
+            for (size_t c = 0; c < w.m; c++) {
+                fprintf(f, c ? ", " : " ");
+                emit_float(f, mat_get(w, r, c));
+            }
+            fprintf(f, " },\n");
+        }
+        fprintf(f, "};\n\n");
+
+        fprintf(f, "static const float b%zu[%zu] = {", i, l.b.n);
+        for (size_t r = 0; r < l.b.n; r++) {
+            fprintf(f, r ? ", " : " ");
+            emit_float(f, mat_get(l.b, r, 0));
+        }
+        fprintf(f, " };\n\n");
+    }
+}
+
+// Writes the softmax of the len outputs in y, taking
+// their max out before exponentiating.
+static void emit_softmax(FILE *f, size_t len, const char *y) {
+    fprintf(f, "    {\n        float max = %s[0], sum = 0.0f;\n", y);
+    fprintf(f, "        for (int r = 1; r < %zu; r++)\n", len);
+    fprintf(f, "            max = %s[r] > max ? %s[r] : max;\n", y, y);
+    fprintf(f, "        for (int r = 0; r < %zu; r++) {\n", len);
+    fprintf(f, "            %s[r] = nnc_exp(%s[r] - max);\n", y, y);
+    fprintf(f, "            sum += %s[r];\n        }\n", y);
+    fprintf(f, "        for (int r = 0; r < %zu; r++)\n", len);
+    fprintf(f, "            %s[r] /= sum;\n    }\n", y);
+}
+
+// Writes the i'th layer, reading x and writing y.
+static void emit_layer(FILE *f, Layer l, size_t i, const char *x, const char *y) {
+    fprintf(f, "    // Layer %zu, %zu -> %zu.\n", i, l.w.m, l.w.n);
+    if (layer_loops(l)) {
+        fprintf(f, "    {\n        float z[%zu];\n", l.w.n);
+        fprintf(f, "        for (int r = 0; r < %zu; r++)\n", l.w.n);
+        fprintf(f, "            z[r] = b%zu[r];\n", i);
+        fprintf(f, "        for (int c = 0; c < %zu; c++)\n", l.w.m);
+        fprintf(f, "            for (int r = 0; r < %zu; r++)\n", l.w.n);
+        fprintf(f, "                z[r] += w%zu[c][r] * %s[c];\n", i, x);
+        fprintf(f, "        for (int r = 0; r < %zu; r++)\n", l.w.n);
+        fprintf(f, "            %s[r] = ", y);
+        emit_act(f, l.act_func, "z[r]");
+        fprintf(f, ";\n    }\n");
+        if (l.act_func == SOFTMAX) emit_softmax(f, l.w.n, y);
+        return;
+    }
+
+    // The activation goes in its own loop, so the branch-free
+    // approximations are vectorized across the outputs.
+    fprintf(f, "    {\n        float z[%zu];\n", l.w.n);
+    for (size_t r = 0; r < l.w.n; r++) {
+        fprintf(f, "        z[%zu] = b%zu[%zu]", r, i, r);
+        for (size_t c = 0; c < l.w.m; c++)
+            fprintf(f, "\n            + w%zu[%zu][%zu] * %s[%zu]", i, r, c, x, c);
+        fprintf(f, ";\n");
+    }
+    fprintf(f, "        for (int r = 0; r < %zu; r++)\n", l.w.n);
+    fprintf(f, "            %s[r] = ", y);
+    emit_act(f, l.act_func, "z[r]");
+    fprintf(f, ";\n    }\n");
+    if (l.act_func == SOFTMAX) emit_softmax(f, l.w.n, y);
+}
+
+static void emit(FILE *f, NN n, const char *model, const char *name) {
+    char upper[256];
+    size_t len = strlen(name) < sizeof(upper) - 1 ? strlen(name) : sizeof(upper) - 1;
+    for (size_t i = 0; i < len; i++)
+        upper[i] = toupper((unsigned char) name[i]);
+    upper[len] = '\0';
+
+    size_t outputs = n.l[n.len-1].w.n;
+    fprintf(f, "// Generated by nnc from %s, do not edit.\n", model);
+    fprintf(f, "#include <stdint.h>\n#include <string.h>\n\n");
+    fprintf(f, "#define %s_INPUTS %zu\n", upper, n.xs);
+    fprintf(f, "#define %s_OUTPUTS %zu\n\n", upper, outputs);
+
+    bool approx = false;
+    for (size_t i = 0; i < n.len; i++)
+        approx |= n.l[i].act_func == TANH || n.l[i].act_func == SIGMOID
+               || n.l[i].act_func == SOFTMAX;
+    if (approx) fputs(act_prelude, f);
+    emit_weights(f, n);
+
+    fprintf(f, "void %s(const float *in, float *out) {\n", name);
+    for (size_t i = 0; i + 1 < n.len; i++)
+        fprintf(f, "    float a%zu[%zu];\n", i, n.l[i].w.n);
+
+    char x[32], y[32];
+    for (size_t i = 0; i < n.len; i++) {
+        snprintf(x, sizeof(x), i > 0 ? "a%zu" : "in", i - 1);
+        snprintf(y, sizeof(y), i + 1 < n.len ? "a%zu" : "out", i);
+        emit_layer(f, n.l[i], i, x, y);
+    }
+    fprintf(f, "}\n");
+}
+
+int main(int argc, char **argv) {
+    const char *model = NULL, *path = NULL, *name = "predict";
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) path = argv[++i];
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) name = argv[++i];
+        else if (!model && argv[i][0] != '-') model = argv[i];
+        else usage();
+    }
+    if (!model) usage();
+
+    NN n = nn_from(model);
+    FILE *f = path ? fopen(path, "w") : stdout;
+    if (!f) {
+        perror("Error opening output");
+        exit(1);
+    }
+
+    emit(f, n, model, name);
+    if (path) fclose(f);
+    nn_del(n);
+    return 0;
+}
@@ -0,0 +1,479 @@
+// Inference server over a Unix domain socket. Requests that
+// arrive together are forwarded as one micro-batch of at most
+// -b samples, waiting at most -w microseconds for it to fill,
+// so many tiny matrix-vector products become one product.
+// Every -r seconds the throughput, the mean batch and the p50
+// and p99 latencies from a request being read to its answer
+// being written are printed.
+//
+//   nnserve <model.nn> [-s socket] [-b batch] [-w wait_us] [-t threads] [-r secs]
+//   nnserve -c [-s socket] [-j clients] [-n requests]
+//
+// The protocol is native-endian binary. On connection the
+// server sends two uint32, the inputs and the outputs of the
+// model, then answers every request of `inputs` floats with
+// `outputs` floats, in order. Requests can be pipelined.
+//
+// With -c it runs as a load generator instead, -j clients
+// sending -n requests each, one at a time, and prints the
+// latencies and throughput they saw.
+#include "../nn/nn.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define NNSERVE_SOCKET "/tmp/nnserve.sock"
+#define NNSERVE_BATCH 64
+#define NNSERVE_WAIT_US 500
+#define NNSERVE_REPORT 5
+
+// Requests read but not forwarded yet, readers
+// block when the queue is full.
+#define NNSERVE_QUEUE 4096
+
+// A connection is closed when its reader is done
+// and every one of its requests was answered.
+typedef struct Conn {
+    int fd;
+    atomic_size_t refs;
+} Conn;
+
+typedef struct Request {
+    Conn *c;
+    double t;
+} Request;
+
+typedef struct Server {
+    NN n;
+    ThreadPool *pool;
+    size_t xs, ys, max_batch;
+    double max_wait, report;
+
+    // Ring of pending requests, the inputs
+    // of the i'th one are at qx + i*xs.
+    pthread_mutex_t lock;
+    pthread_cond_t ready, space;
+    Request *q;
+    float *qx;
+    size_t head, len;
+
+    // Latencies and batches of the current report window.
+    double *lat;
+    size_t lat_len, lat_cap, batches;
+    double since;
+} Server;
+
+typedef struct Reader {
+    Server *s;
+    Conn *c;
+} Reader;
+
+static volatile sig_atomic_t quit;
+
+static void on_signal(int sig) {
+    (void) sig;
+    quit = 1;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+        "usage: nnserve <model.nn> [-s socket] [-b batch] [-w wait_us] [-t threads] [-r secs]\n"
+        "       nnserve -c [-s socket] [-j clients] [-n requests]\n");
+    exit(1);
+}
+
+// Seconds since an arbitrary point, never going back.
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Reads exactly len bytes. Returns false on end of file or error.
+static bool read_full(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t r = read(fd, p, len);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        p += r;
+        len -= r;
+    }
+    return true;
+}
+
+// Writes exactly len bytes. Returns false on error.
+static bool write_full(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        p += w;
+        len -= w;
+    }
+    return true;
+}
+
+static void conn_put(Conn *c) {
+    if (atomic_fetch_sub(&c->refs, 1) == 1) {
+        close(c->fd);
+        free(c);
+    }
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Returns the p'th percentile of the sorted v.
+static double percentile(const double *v, size_t len, double p) {
+    if (len == 0) return 0;
+    size_t i = (size_t) (p * (len - 1) + 0.5);
+    return v[i];
+}
+
+// Sorts the latencies of v and prints them in microseconds.
+static void print_latency(double *v, size_t len, double secs) {
+    qsort(v, len, sizeof(double), cmp_double);
+    printf("%.0lf req/s, p50 = %.1lf us, p99 = %.1lf us",
+           secs > 0 ? len / secs : 0,
+           percentile(v, len, 0.50) * 1e6,
+           percentile(v, len, 0.99) * 1e6);
+}
+
+// Prints and resets the stats of the window. Holds the lock.
+static void server_report(Server *s, double t) {
+    printf("served %zu in %zu batches (%.1lf per batch), ", s->lat_len, s->batches,
+           s->batches > 0 ? (double) s->lat_len / s->batches : 0);
+    print_latency(s->lat, s->lat_len, t - s->since);
+    puts("");
+    fflush(stdout);
+    s->lat_len = 0;
+    s->batches = 0;
+    s->since = t;
+}
+
+static void server_record(Server *s, double lat) {
+    if (s->lat_len == s->lat_cap) {
+        s->lat_cap = s->lat_cap ? s->lat_cap * 2 : 1024;
+        s->lat = realloc(s->lat, s->lat_cap * sizeof(double));
+        assert(s->lat != NULL);
+    }
+    s->lat[s->lat_len++] = lat;
+}
+
+// Reads the requests of a connection into the queue.
+static void *reader_run(void *arg) {
+    Reader r = *(Reader *) arg;
+    Server *s = r.s;
+    free(arg);
+
+    float *x = malloc(s->xs * sizeof(float));
+    assert(x != NULL);
+    while (read_full(r.c->fd, x, s->xs * sizeof(float))) {
+        double t = now();
+        pthread_mutex_lock(&s->lock);
+        while (s->len == NNSERVE_QUEUE)
+            pthread_cond_wait(&s->space, &s->lock);
+
+        size_t i = (s->head + s->len++) % NNSERVE_QUEUE;
+        atomic_fetch_add(&r.c->refs, 1);
+        s->q[i] = (Request) { .c = r.c, .t = t };
+        memcpy(s->qx + i * s->xs, x, s->xs * sizeof(float));
+        pthread_cond_signal(&s->ready);
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    free(x);
+    conn_put(r.c);
+    return NULL;
+}
+
+// Waits on cond until the time t of now() at the latest.
+static void wait_until(pthread_cond_t *cond, pthread_mutex_t *lock, double t) {
+    struct timespec ts = {
+        .tv_sec = (time_t) t,
+        .tv_nsec = (long) ((t - (time_t) t) * 1e9),
+    };
+    pthread_cond_timedwait(cond, lock, &ts);
+}
+
+// Waits for a micro-batch and moves it out of the queue into
+// batch and x. The batch is closed when it is full or when its
+// first request has waited max_wait. Returns its length, 0
+// when the report window ended first.
+static size_t server_take(Server *s, Request *batch, float *x) {
+    pthread_mutex_lock(&s->lock);
+    while (s->len == 0 && now() < s->since + s->report && !quit)
+        wait_until(&s->ready, &s->lock, s->since + s->report);
+
+    if (s->len == 0) {
+        server_report(s, now());
+        pthread_mutex_unlock(&s->lock);
+        return 0;
+    }
+
+    double deadline = s->q[s->head].t + s->max_wait;
+    while (s->len < s->max_batch && now() < deadline && !quit)
+        wait_until(&s->ready, &s->lock, deadline);
+
+    size_t len = s->len < s->max_batch ? s->len : s->max_batch;
+    for (size_t i = 0; i < len; i++) {
+        size_t k = (s->head + i) % NNSERVE_QUEUE;
+        batch[i] = s->q[k];
+        memcpy(x + i * s->xs, s->qx + k * s->xs, s->xs * sizeof(float));
+    }
+
+    s->head = (s->head + len) % NNSERVE_QUEUE;
+    s->len -= len;
+    pthread_cond_broadcast(&s->space);
+    pthread_mutex_unlock(&s->lock);
+    return len;
+}
+
+// Forwards micro-batches and answers them until quit is set.
+static void *server_run(void *arg) {
+    Server *s = arg;
+    Request *batch = malloc(s->max_batch * sizeof(Request));
+    float *x = malloc(s->max_batch * s->xs * sizeof(float));
+    float *y = malloc(s->ys * sizeof(float));
+    assert(batch != NULL && x != NULL && y != NULL);
+
+    while (!quit) {
+        size_t len = server_take(s, batch, x);
+        if (len == 0) continue;
+
+        Set in = { .data = x, .n = len, .m = s->xs, .stride = s->xs, .dtype = MAT_F32 };
+        Mat out = nn_forward_par(s->n, s->pool, in);
+        for (size_t i = 0; i < len; i++) {
+            for (size_t k = 0; k < s->ys; k++)
+                y[k] = MAT_AT(out, k, i);
+            // A client that went away only loses its answers.
+            write_full(batch[i].c->fd, y, s->ys * sizeof(float));
+            batch[i].t = now() - batch[i].t;
+        }
+
+        pthread_mutex_lock(&s->lock);
+        for (size_t i = 0; i < len; i++) {
+            server_record(s, batch[i].t);
+            conn_put(batch[i].c);
+        }
+
+        s->batches++;
+        if (now() >= s->since + s->report) server_report(s, now());
+        pthread_mutex_unlock(&s->lock);
+    }
+
+    free(batch);
+    free(x);
+    free(y);
+    return NULL;
+}
+
+// Returns a Unix socket address for path.
+static struct sockaddr_un sock_addr(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+    return addr;
+}
+
+static int serve(const char *model, const char *path, size_t max_batch,
+                 double wait_us, size_t threads, double report) {
+    Server s = {
+        .n = nn_from(model),
+        .pool = threads > 0 ? thpool_new(threads) : NULL,
+        .max_batch = max_batch,
+        .max_wait = wait_us * 1e-6,
+        .report = report,
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .space = PTHREAD_COND_INITIALIZER,
+    };
+
+    // Deadlines are taken from now(), so the
+    // clock of the waits can't jump either.
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&s.ready, &attr);
+    pthread_condattr_destroy(&attr);
+
+    s.xs = s.n.xs;
+    s.ys = s.n.l[s.n.len-1].w.n;
+    s.q = malloc(NNSERVE_QUEUE * sizeof(Request));
+    s.qx = malloc(NNSERVE_QUEUE * s.xs * sizeof(float));
+    assert(s.q != NULL && s.qx != NULL);
+    nn_reserve(s.n, max_batch);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = sock_addr(path);
+    unlink(path);
+    if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 128) < 0) {
+        perror("Error opening socket");
+        exit(1);
+    }
+
+    printf("serving %s on %s, %zu -> %zu, batch %zu, wait %.0lf us\n",
+           model, path, s.xs, s.ys, max_batch, wait_us);
+    fflush(stdout);
+
+    s.since = now();
+    pthread_t server;
+    pthread_create(&server, NULL, server_run, &s);
+
+    uint32_t dims[2] = { s.xs, s.ys };
+    while (!quit) {
+        int c = accept(fd, NULL, NULL);
+        if (c < 0) {
+            if (errno == EINTR) continue;
+            perror("Error accepting connection");
+            break;
+        }
+
+        if (!write_full(c, dims, sizeof(dims))) {
+            close(c);
+            continue;
+        }
+
+        Conn *conn = malloc(sizeof(Conn));
+        Reader *r = malloc(sizeof(Reader));
+        assert(conn != NULL && r != NULL);
+        conn->fd = c;
+        atomic_init(&conn->refs, 1);
+        *r = (Reader) { .s = &s, .c = conn };
+
+        pthread_t t;
+        pthread_create(&t, NULL, reader_run, r);
+        pthread_detach(t);
+    }
+
+    // Readers still blocked on their clients
+    // are left to the end of the process.
+    quit = 1;
+    pthread_mutex_lock(&s.lock);
+    pthread_cond_broadcast(&s.ready);
+    pthread_mutex_unlock(&s.lock);
+    pthread_join(server, NULL);
+    close(fd);
+    unlink(path);
+    if (s.pool) thpool_del(s.pool);
+    nn_del(s.n);
+    return 0;
+}
+
+typedef struct Client {
+    const char *path;
+    size_t requests;
+    double *lat;
+    bool ok;
+} Client;
+
+static int sock_connect(const char *path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = sock_addr(path);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Sends random requests one at a time, timing each answer.
+static void *client_run(void *arg) {
+    Client *c = arg;
+    int fd = sock_connect(c->path);
+    uint32_t dims[2];
+    if (fd < 0 || !read_full(fd, dims, sizeof(dims))) return NULL;
+
+    float *x = malloc(dims[0] * sizeof(float));
+    float *y = malloc(dims[1] * sizeof(float));
+    assert(x != NULL && y != NULL);
+    unsigned seed = (unsigned) (uintptr_t) c;
+    for (size_t i = 0; i < c->requests; i++) {
+        for (size_t j = 0; j < dims[0]; j++)
+            x[j] = (float) rand_r(&seed) / RAND_MAX * 2 - 1;
+        double t = now();
+        if (!write_full(fd, x, dims[0] * sizeof(float))
+            || !read_full(fd, y, dims[1] * sizeof(float)))
+            goto out;
+        c->lat[i] = now() - t;
+    }
+    c->ok = true;
+
+out:
+    free(x);
+    free(y);
+    close(fd);
+    return NULL;
+}
+
+static int load(const char *path, size_t clients, size_t requests) {
+    Client *c = calloc(clients, sizeof(Client));
+    pthread_t *t = malloc(clients * sizeof(pthread_t));
+    double *lat = malloc(clients * requests * sizeof(double));
+    assert(c != NULL && t != NULL && lat != NULL);
+
+    double start = now();
+    for (size_t i = 0; i < clients; i++) {
+        c[i] = (Client) { .path = path, .requests = requests, .lat = lat + i * requests };
+        pthread_create(&t[i], NULL, client_run, &c[i]);
+    }
+
+    size_t ok = 0;
+    for (size_t i = 0; i < clients; i++) {
+        pthread_join(t[i], NULL);
+        if (c[i].ok) memmove(lat + ok++ * requests, c[i].lat, requests * sizeof(double));
+    }
+
+    double secs = now() - start;
+    if (ok < clients)
+        fprintf(stderr, "%zu of %zu clients failed\n", clients - ok, clients);
+    printf("%zu clients, %zu requests, ", ok, ok * requests);
+    print_latency(lat, ok * requests, secs);
+    puts("");
+
+    free(c);
+    free(t);
+    free(lat);
+    return ok == clients ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    const char *model = NULL, *path = NNSERVE_SOCKET;
+    size_t batch = NNSERVE_BATCH, threads = 0, clients = 8, requests = 10000;
+    double wait_us = NNSERVE_WAIT_US, report = NNSERVE_REPORT;
+    bool client = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-c") == 0) client = true;
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) path = argv[++i];
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) batch = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) wait_us = atof(argv[++i]);
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) threads = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) report = atof(argv[++i]);
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) clients = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) requests = strtoul(argv[++i], NULL, 10);
+        else if (!model && argv[i][0] != '-') model = argv[i];
+        else usage();
+    }
+
+    if (client) {
+        if (model || clients == 0) usage();
+        return load(path, clients, requests);
+    }
+    if (!model || batch == 0 || report <= 0) usage();
+
+    // Writes to clients that went away fail instead of killing
+    // the server, and the signals interrupt accept() to stop it.
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa = { .sa_handler = on_signal };
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    return serve(model, path, batch, wait_us, threads, report);
+}